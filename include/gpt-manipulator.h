@@ -20,21 +20,39 @@
  * SOFTWARE.
  */
 
+#ifndef GPT_MANIPULATOR_H
+#define GPT_MANIPULATOR_H
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
-#define GPT_DEFAULT_SIGNATURE "EFI_PART"
+#define GPT_DEFAULT_SIGNATURE "EFI PART"
 #define GPT_DEFAULT_LBA_SIZE 512
 #define GPT_DEFAULT_OFFSET 1
+#define GPT_DEFAULT_ENTRIES 128
+#define GPT_DEFAULT_ENTRY_SIZE 128
+#define GPT_REVISION 0x00010000
+#define GPT_DEFAULT_DISCOVER_DEPTH 4
+#define GPT_DEFAULT_DISCOVER_TABLES 1024
+#define GPT_DEFAULT_DISCOVER_WORKERS 4
+#define GPT_DEFAULT_SCRUB_INTERVAL 3600000
+#define GPT_MAX_CUSTOM_TYPES 256
+#define GPT_DEFAULT_CACHE_NAME "/gpt-manipulator-cache"
+#define GPT_DEFAULT_CACHE_SLOTS 256
+#define GPT_CACHE_MAX_ENTRIES 128
+#define GPT_MBR_SIGNATURE 0xAA55
+#define GPT_MBR_TYPE_PROTECTIVE 0xEE
 
 struct GPT_Handle {
   void *file;
   uint64_t offset;
   unsigned int lba_size;
+  void *cache;
 };
 
 struct GPT_Header {
@@ -62,6 +80,72 @@ struct GPT_Entry {
     uint16_t name[36];
 };
 
+struct GPT_MBR_Partition {
+  uint8_t status;
+  uint8_t chs_first[3];
+  uint8_t type;
+  uint8_t chs_last[3];
+  uint32_t first_lba;
+  uint32_t sectors;
+};
+
+struct GPT_MBR {
+  uint8_t boot_code[440];
+  uint32_t disk_signature;
+  uint16_t reserved;
+  struct GPT_MBR_Partition partitions[4];
+  uint16_t signature;
+};
+
+enum GPT_MBR_Type {
+  GPT_MBR_NONE,
+  GPT_MBR_PROTECTIVE,
+  GPT_MBR_HYBRID,
+  GPT_MBR_LEGACY,
+};
+
+/**
+ * Partition entry as stored in a snapshot file. Entries are accessed in
+ *      place, the type GUID is stored once per snapshot and referenced
+ *      by type_index.
+ */
+struct GPT_Snapshot_Entry {
+  uint64_t first_lba;
+  uint64_t last_lba;
+  uint64_t attributes;
+  uint8_t guid[16];
+  uint32_t type_index;
+  uint32_t slot;
+  uint16_t name[36];
+};
+
+struct GPT_Snapshot_Writer;
+struct GPT_Snapshot;
+
+/**
+ * GPT table found by gpt_discover_tables. Positions in header and entries
+ *      are relative to offset, the start of the (nested) disk.
+ */
+struct GPT_Table_Node {
+  uint64_t offset;
+  uint64_t lba_count;
+  unsigned int depth;
+  uint32_t parent_entry;
+  struct GPT_Header header;
+  struct GPT_Entry *entries;
+  struct GPT_Table_Node **children;
+  uint32_t child_count;
+};
+
+/**
+ * max_tables_per_level and workers use the defaults if set to 0.
+ */
+struct GPT_Discover_Options {
+  unsigned int max_depth;
+  unsigned int max_tables_per_level;
+  unsigned int workers;
+};
+
 enum GPT_Error {
   GPT_SUCCESS,
   GPT_CRC32_MISMATCH,
@@ -72,9 +156,99 @@ enum GPT_Error {
   GPT_BAD_HEADER_SIZE,
   GPT_BAD_SECONDARY_POSITION,
   GPT_BAD_ENTRIES_POSITION,
+  GPT_BAD_DISK_SIZE,
+  GPT_ALLOCATION_ERROR,
+  GPT_SYNC_ERROR,
+  GPT_READ_ERROR,
+  GPT_SECONDARY_MISMATCH,
+  GPT_MISSING_MBR,
+  GPT_NO_PROTECTIVE_PARTITION,
+  GPT_BAD_PROTECTIVE_POSITION,
+  GPT_BAD_PROTECTIVE_SIZE,
+  GPT_HYBRID_MBR,
 
 };
 
+/**
+ * Partition types known to gpt_classify_entry. Types registered with
+ *      gpt_register_type are numbered from GPT_TYPE_CUSTOM on.
+ */
+enum GPT_Type {
+  GPT_TYPE_UNKNOWN,
+  GPT_TYPE_UNUSED,
+  GPT_TYPE_EFI_SYSTEM,
+  GPT_TYPE_BIOS_BOOT,
+  GPT_TYPE_MICROSOFT_RESERVED,
+  GPT_TYPE_MICROSOFT_BASIC_DATA,
+  GPT_TYPE_MICROSOFT_LDM_METADATA,
+  GPT_TYPE_MICROSOFT_LDM_DATA,
+  GPT_TYPE_WINDOWS_RECOVERY,
+  GPT_TYPE_LINUX_FILESYSTEM,
+  GPT_TYPE_LINUX_SWAP,
+  GPT_TYPE_LINUX_LVM,
+  GPT_TYPE_LINUX_RAID,
+  GPT_TYPE_LINUX_RESERVED,
+  GPT_TYPE_LINUX_HOME,
+  GPT_TYPE_LINUX_SRV,
+  GPT_TYPE_LINUX_VAR,
+  GPT_TYPE_LINUX_ROOT_X86,
+  GPT_TYPE_LINUX_ROOT_X86_64,
+  GPT_TYPE_LINUX_ROOT_ARM,
+  GPT_TYPE_LINUX_ROOT_ARM64,
+  GPT_TYPE_LINUX_USR_X86_64,
+  GPT_TYPE_LINUX_EXTENDED_BOOT,
+  GPT_TYPE_LINUX_LUKS,
+  GPT_TYPE_LINUX_DM_CRYPT,
+  GPT_TYPE_APPLE_HFS,
+  GPT_TYPE_APPLE_APFS,
+  GPT_TYPE_APPLE_BOOT,
+  GPT_TYPE_FREEBSD_BOOT,
+  GPT_TYPE_FREEBSD_SWAP,
+  GPT_TYPE_FREEBSD_UFS,
+  GPT_TYPE_FREEBSD_ZFS,
+  GPT_TYPE_CHROMEOS_KERNEL,
+  GPT_TYPE_CHROMEOS_ROOT,
+  GPT_TYPE_VMWARE_VMFS,
+  GPT_TYPE_CEPH_OSD,
+  GPT_TYPE_COUNT,
+  GPT_TYPE_CUSTOM = 1024,
+};
+
+enum GPT_Scrub_Check {
+  GPT_SCRUB_HEADER,
+  GPT_SCRUB_ENTRIES,
+  GPT_SCRUB_SECONDARY,
+};
+
+/**
+ * Called by the scrubber thread for every failed check
+ * @param handle GPT Handle of device
+ * @param check  Failed check
+ * @param error  Error code of check
+ * @param data   User data of scrubber
+ */
+typedef void (*GPT_Scrub_Callback)(struct GPT_Handle *handle,
+                                    enum GPT_Scrub_Check check,
+                                    enum GPT_Error error, void *data);
+
+/**
+ * Rates are in bytes per second, 0 disables the limit. Bursts are the
+ *      bucket sizes in bytes. interval and jitter are in milliseconds.
+ */
+struct GPT_Scrubber_Options {
+  uint64_t device_rate;
+  uint64_t device_burst;
+  uint64_t global_rate;
+  uint64_t global_burst;
+  unsigned int interval;
+  unsigned int jitter;
+  GPT_Scrub_Callback callback;
+  void *data;
+};
+
+struct GPT_Scrubber;
+struct GPT_Cache;
+
 /**
  * Create a GPT Handle
  * @param  path     Path to device or image with GPT table
@@ -99,6 +273,33 @@ struct GPT_Handle *gpt_create_handle_with_signature(const char *path,
                                                     uint64_t offset,
                                                     bool read_only);
 
+/**
+ * Create a GPT Handle, LBA size and table position are detected. The
+ *      first 8 KiB are searched for a primary header with 512 or 4096 byte
+ *      sectors, if none is found the last 4 KiB are searched for a
+ *      secondary header to detect the LBA size. The handle always refers
+ *      to the primary header at LBA 1; if it is damaged,
+ *      gpt_read_secondary_header reads the backup to repair it from.
+ * @param  path      Path to device or image with GPT table
+ * @param  read_only Open device or image read only
+ * @return           returns NULL on error or if no table was found
+ */
+struct GPT_Handle *gpt_create_handle_autodetect(const char *path,
+                                                  bool read_only);
+
+/**
+ * Create a GPT Handle like gpt_create_handle_autodetect, but with a non
+ *      standard GPT Signature
+ * @param  path      Path to device or image with GPT table
+ * @param  signature Non standard GPT Signature
+ * @param  read_only Open device or image read only
+ * @return           returns NULL on error or if no table was found
+ */
+struct GPT_Handle *gpt_create_handle_autodetect_with_signature(
+                                                    const char *path,
+                                                    const char *signature,
+                                                    bool read_only);
+
 /**
  * Free resources needed by handle
  * @param handle Handle to free
@@ -112,6 +313,55 @@ void gpt_close_handle(struct GPT_Handle *handle);
  */
 struct GPT_Header *gpt_read_header(struct GPT_Handle *handle);
 
+/**
+ * Reads secondary GPT from the last LBA of the disk, e.g. to repair a
+ *      damaged primary header. The header is not verified.
+ * @param handle GPT Handle
+ * @return       returns NULL on error
+ */
+struct GPT_Header *gpt_read_secondary_header(struct GPT_Handle *handle);
+
+/**
+ * Reads GPT and MBR from GPT Handle with a single read from LBA 0 up to
+ *      the GPT Header
+ * @param handle GPT Handle
+ * @param mbr    MBR to fill, zeroed if the table is too far behind LBA 0
+ * @return       returns NULL on error
+ */
+struct GPT_Header *gpt_read_header_with_mbr(struct GPT_Handle *handle,
+                                              struct GPT_MBR *mbr);
+
+/**
+ * Classify MBR as missing, protective, hybrid or legacy MBR
+ * @param  mbr MBR
+ * @return     returns MBR type
+ */
+enum GPT_MBR_Type gpt_mbr_type(struct GPT_MBR *mbr);
+
+/**
+ * Verify protective MBR against GPT Header and disk size. The size of
+ *      the 0xEE partition is only checked for pure protective MBRs.
+ * @param  handle GPT Handle
+ * @param  header GPT Header
+ * @param  mbr    MBR
+ * @return        returns error code, GPT_HYBRID_MBR for an otherwise
+ *                        valid hybrid MBR
+ */
+enum GPT_Error gpt_verify_mbr(struct GPT_Handle *handle,
+                                struct GPT_Header *header,
+                                struct GPT_MBR *mbr);
+
+/**
+ * Make MBR protective for GPT Header. Boot code and disk signature
+ *      are kept.
+ * @param mbr         MBR to modify
+ * @param header      GPT Header
+ * @param keep_hybrid Only resize an existing protective partition, and only
+ *                    if it ends behind all hybrid partitions
+ */
+void gpt_set_protective_mbr(struct GPT_MBR *mbr, struct GPT_Header *header,
+                              bool keep_hybrid);
+
 /**
  * Free resources needed by header
  * @param header Header to free
@@ -158,6 +408,54 @@ void gpt_refresh_crc32(struct GPT_Header *header);
  */
 void gpt_refresh_entries(struct GPT_Header *header, struct GPT_Entry *entries);
 
+/**
+ * Move used entries to the front and sort them by first LBA. Entries with
+ *      equal first LBA and unused entries keep their order. Entries and
+ *      header CRC32 checksums are recalculated.
+ * @param  header      GPT header
+ * @param  entries     All GPT Entries
+ * @param  permutation NULL or array with one element per entry, receives
+ *                     the new index of every old index
+ * @return             returns error code
+ */
+enum GPT_Error gpt_sort_entries(struct GPT_Header *header,
+                                  struct GPT_Entry *entries,
+                                  uint32_t *permutation);
+
+/**
+ * Classify partition by its type GUID
+ * @param  entry GPT Entry
+ * @param  name  NULL or receives the name of the type
+ * @return       returns GPT_TYPE_UNKNOWN for unknown types
+ */
+enum GPT_Type gpt_classify_entry(struct GPT_Entry *entry, const char **name);
+
+/**
+ * Classify all partitions
+ * @param header  GPT Header
+ * @param entries All GPT Entries
+ * @param types   Array with one element per entry, receives types
+ */
+void gpt_classify_entries(struct GPT_Header *header, struct GPT_Entry *entries,
+                            enum GPT_Type *types);
+
+/**
+ * Name of partition type
+ * @param  type Partition type
+ * @return      returns NULL for invalid types
+ */
+const char *gpt_type_name(enum GPT_Type type);
+
+/**
+ * Register an additional partition type. Registered types can't be
+ *      removed and are shared by all threads.
+ * @param  guid Type GUID (16 bytes)
+ * @param  name Name of type, will be copied
+ * @return      returns GPT_TYPE_UNKNOWN on error, the existing type if
+ *                      guid is already known
+ */
+enum GPT_Type gpt_register_type(const uint8_t *guid, const char *name);
+
 /**
  * Write GPT Header to device or image. The secondary GPT Header
  *      won't be wirtten to disk.
@@ -168,6 +466,27 @@ void gpt_refresh_entries(struct GPT_Header *header, struct GPT_Entry *entries);
 enum GPT_Error gpt_write_header(struct GPT_Handle *handle,
                                     struct GPT_Header *header);
 
+/**
+ * Write MBR and GPT Header to device or image. A header at LBA 1 is
+ *      written together with LBA 0 in a single write, the rest of LBA 0
+ *      behind the MBR is zeroed.
+ * @param  handle GPT Handle
+ * @param  header GPT Header
+ * @param  mbr    MBR, NULL to write the header only
+ * @return        returns error code
+ */
+enum GPT_Error gpt_write_header_with_mbr(struct GPT_Handle *handle,
+                                            struct GPT_Header *header,
+                                            struct GPT_MBR *mbr);
+
+/**
+ * Write MBR to device or image
+ * @param  handle GPT Handle
+ * @param  mbr    MBR
+ * @return        returns error code
+ */
+enum GPT_Error gpt_write_mbr(struct GPT_Handle *handle, struct GPT_MBR *mbr);
+
 /**
  * Write GPT entries to device or image
  * @param  handle    GPT Handle
@@ -214,6 +533,219 @@ enum GPT_Error gpt_verify_entries(struct GPT_Handle *handle,
 enum GPT_Error gpt_verify_scondary_header(struct GPT_Handle *handle,
                                               struct GPT_Header *header);
 
+/**
+ * Create a new and empty GPT on device or image. Only a new protective MBR,
+ *      the primary and the secondary table are written; images are extended
+ *      sparsely and old table areas are deallocated instead of overwritten
+ *      where possible.
+ * @param  handle    GPT Handle
+ * @param  lba_count Size of disk in LBA, 0 to keep the current size
+ * @param  entries   Number of partition entries
+ * @param  guid      Disk GUID (16 bytes), NULL to generate a random GUID
+ * @return           returns error code
+ */
+enum GPT_Error gpt_create_table(struct GPT_Handle *handle, uint64_t lba_count,
+                                  uint32_t entries, const uint8_t *guid);
+
+/**
+ * Move secondary GPT Header and entries to the end of a grown device or
+ *      image. position_secondary and last_partition_lba are updated and
+ *      committed by rewriting the primary GPT Header last.
+ * @param  handle    GPT Handle
+ * @param  header    GPT Header, updated on success
+ * @param  entries   All GPT Entries
+ * @param  lba_count New size of disk in LBA, 0 to use the current size.
+ *                   Images are extended sparsely if needed.
+ * @return           returns error code
+ */
+enum GPT_Error gpt_relocate_secondary(struct GPT_Handle *handle,
+                                        struct GPT_Header *header,
+                                        struct GPT_Entry *entries,
+                                        uint64_t lba_count);
+
+/**
+ * Create a snapshot file for many GPT tables
+ * @param  path Path of snapshot file, will be truncated
+ * @return      returns NULL on error
+ */
+struct GPT_Snapshot_Writer *gpt_snapshot_create(const char *path);
+
+/**
+ * Append GPT table to snapshot. Only used entries are stored. After a
+ *      write error the writer stays failed and gpt_snapshot_close returns
+ *      the error without completing the snapshot.
+ * @param  writer  Snapshot writer
+ * @param  header  GPT Header
+ * @param  entries All GPT Entries
+ * @return         returns error code
+ */
+enum GPT_Error gpt_snapshot_add(struct GPT_Snapshot_Writer *writer,
+                                  struct GPT_Header *header,
+                                  struct GPT_Entry *entries);
+
+/**
+ * Write type GUIDs and table index, then free resources needed by writer
+ * @param  writer Snapshot writer
+ * @return        returns error code
+ */
+enum GPT_Error gpt_snapshot_close(struct GPT_Snapshot_Writer *writer);
+
+/**
+ * Map snapshot file into memory. Only the file header is validated,
+ *      tables are accessed in place.
+ * @param  path Path of snapshot file
+ * @return      returns NULL on error
+ */
+struct GPT_Snapshot *gpt_snapshot_open(const char *path);
+
+/**
+ * Unmap snapshot and free resources needed by it
+ * @param snapshot Snapshot to free
+ */
+void gpt_snapshot_free(struct GPT_Snapshot *snapshot);
+
+/**
+ * Number of tables stored in snapshot
+ * @param  snapshot Snapshot
+ * @return          returns number of tables
+ */
+uint32_t gpt_snapshot_tables(struct GPT_Snapshot *snapshot);
+
+/**
+ * Read GPT Header of a table in snapshot
+ * @param  snapshot Snapshot
+ * @param  table    Table number
+ * @param  header   GPT Header to fill
+ * @return          returns false on error
+ */
+bool gpt_snapshot_get_header(struct GPT_Snapshot *snapshot, uint32_t table,
+                              struct GPT_Header *header);
+
+/**
+ * Get used entries of a table in snapshot without copying
+ * @param  snapshot Snapshot
+ * @param  table    Table number
+ * @param  count    Number of returned entries
+ * @return          returns NULL on error, pointer into snapshot otherwise
+ */
+const struct GPT_Snapshot_Entry *gpt_snapshot_get_entries(
+                                            struct GPT_Snapshot *snapshot,
+                                            uint32_t table, uint32_t *count);
+
+/**
+ * Get type GUID referenced by a snapshot entry
+ * @param  snapshot   Snapshot
+ * @param  type_index Type index of entry
+ * @return            returns NULL on error, 16 byte GUID otherwise
+ */
+const uint8_t *gpt_snapshot_type_guid(struct GPT_Snapshot *snapshot,
+                                        uint32_t type_index);
+
+/**
+ * Print GPT table as JSON to a preallocated buffer. Unused entries
+ *      are skipped. Like snprintf, the output is truncated if the buffer
+ *      is too small.
+ * @param  buffer  Output buffer
+ * @param  size    Size of output buffer
+ * @param  header  GPT Header
+ * @param  entries All GPT Entries
+ * @return         returns length of the complete JSON document without
+ *                         the terminating null byte
+ */
+size_t gpt_json_table(char *buffer, size_t size, struct GPT_Header *header,
+                        struct GPT_Entry *entries);
+
+/**
+ * Search used partitions recursively for nested GPT tables. Tables of one
+ *      level are probed in parallel, candidates are accepted only if
+ *      header and entries CRC32 checksums match and the signature equals
+ *      the one of the root table. At most max_tables_per_level partitions
+ *      are probed per level, in entry order.
+ * @param  handle  GPT Handle of outermost disk
+ * @param  options Limits for discovery, NULL for defaults
+ * @return         returns NULL on error, table of handle as root otherwise
+ */
+struct GPT_Table_Node *gpt_discover_tables(struct GPT_Handle *handle,
+                                  const struct GPT_Discover_Options *options);
+
+/**
+ * Free resources needed by table tree
+ * @param root Root of table tree
+ */
+void gpt_free_table_tree(struct GPT_Table_Node *root);
+
+/**
+ * Create a scrubber which verifies primary header, entries and secondary
+ *      header of all added devices in a background thread
+ * @param  options Rate limits, interval and callback, NULL for defaults
+ * @return         returns NULL on error
+ */
+struct GPT_Scrubber *gpt_scrubber_create(
+                                  const struct GPT_Scrubber_Options *options);
+
+/**
+ * Add device to scrubber. The handle has to stay valid until it is
+ *      removed or the scrubber is freed.
+ * @param  scrubber Scrubber
+ * @param  handle   GPT Handle of device
+ * @param  priority Devices with higher priority are scrubbed first
+ * @return          returns false on error
+ */
+bool gpt_scrubber_add(struct GPT_Scrubber *scrubber, struct GPT_Handle *handle,
+                        int priority);
+
+/**
+ * Remove device from scrubber, waits for a running check of the device
+ * @param  scrubber Scrubber
+ * @param  handle   GPT Handle of device
+ * @return          returns false if handle was not added
+ */
+bool gpt_scrubber_remove(struct GPT_Scrubber *scrubber,
+                          struct GPT_Handle *handle);
+
+/**
+ * Stop scrubber thread and free resources needed by scrubber
+ * @param scrubber Scrubber to free
+ */
+void gpt_free_scrubber(struct GPT_Scrubber *scrubber);
+
+/**
+ * Open or create a table cache in POSIX shared memory. Handles attached
+ *      to it read header and entries from the cache if present, verified
+ *      tables read from disk and tables written by this library are
+ *      published to all processes. Headers are published only once they
+ *      are stored on disk.
+ * @param  name  Name of shared memory object, NULL for default
+ * @param  slots Number of cached tables if the cache is created, 0 for
+ *               default
+ * @return       returns NULL on error
+ */
+struct GPT_Cache *gpt_cache_open(const char *name, uint32_t slots);
+
+/**
+ * Unmap cache, all attached handles have to be closed before
+ * @param cache Cache to close
+ */
+void gpt_cache_close(struct GPT_Cache *cache);
+
+/**
+ * Use cache for handle. Devices are identified by device and inode
+ *      number, size, table position and LBA size; changes by other tools
+ *      are not detected.
+ * @param  cache  Cache
+ * @param  handle GPT Handle
+ * @return        returns false on error
+ */
+bool gpt_cache_attach(struct GPT_Cache *cache, struct GPT_Handle *handle);
+
+/**
+ * Drop cached table of handle, e.g. after other tools modified it
+ * @param handle GPT Handle attached to a cache
+ */
+void gpt_cache_invalidate(struct GPT_Handle *handle);
+
 #ifdef __cplusplus
 }
 #endif
+
+#endif
@@ -0,0 +1,331 @@
+/**
+ * Copyright (c) 2017 Viktor Schneider <info@vjs.io>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef GPT_MANIPULATOR_HPP
+#define GPT_MANIPULATOR_HPP
+
+#include <gpt-manipulator.h>
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <ranges>
+#include <span>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+namespace gpt {
+
+/**
+ * GUID in on-disk byte order, the first three fields are little endian
+ */
+struct Guid {
+  std::array<uint8_t, 16> bytes{};
+
+  static constexpr Guid from_bytes(const uint8_t (&data)[16]) {
+    return std::bit_cast<Guid>(data);
+  }
+
+  /**
+   * Parse textual form "C12A7328-F81F-11D2-BA4B-00A0C93EC93B"
+   * @param  text GUID string
+   * @return      returns std::nullopt on error
+   */
+  static constexpr std::optional<Guid> parse(std::string_view text) {
+    constexpr int order[16] = {3, 2, 1, 0, 5, 4, 7, 6,
+                               8, 9, 10, 11, 12, 13, 14, 15};
+    if (text.size() != 36 || text[8] != '-' || text[13] != '-' ||
+        text[18] != '-' || text[23] != '-') {
+      return std::nullopt;
+    }
+
+    Guid guid;
+    std::size_t position = 0;
+    for (int x = 0; x < 16; x++) {
+      if (position == 8 || position == 13 || position == 18 || position == 23) {
+        position++;
+      }
+      int high = hex_value(text[position]);
+      int low = hex_value(text[position + 1]);
+      if (high < 0 || low < 0) {
+        return std::nullopt;
+      }
+      guid.bytes[order[x]] = static_cast<uint8_t>(high << 4 | low);
+      position += 2;
+    }
+    return guid;
+  }
+
+  constexpr bool is_null() const {
+    for (uint8_t byte : bytes) {
+      if (byte != 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  constexpr std::size_t hash() const {
+    uint64_t low = 0, high = 0;
+    for (int x = 0; x < 8; x++) {
+      low |= static_cast<uint64_t>(bytes[x]) << (8 * x);
+      high |= static_cast<uint64_t>(bytes[x + 8]) << (8 * x);
+    }
+    uint64_t value = (low ^ (high * 0x9E3779B97F4A7C15ULL)) *
+                      0xBF58476D1CE4E5B9ULL;
+    return static_cast<std::size_t>(value ^ (value >> 31));
+  }
+
+  std::string to_string() const {
+    constexpr int order[16] = {3, 2, 1, 0, 5, 4, 7, 6,
+                               8, 9, 10, 11, 12, 13, 14, 15};
+    constexpr char hex[] = "0123456789ABCDEF";
+    std::string text;
+    text.reserve(36);
+    for (int x = 0; x < 16; x++) {
+      if (x == 4 || x == 6 || x == 8 || x == 10) {
+        text.push_back('-');
+      }
+      text.push_back(hex[bytes[order[x]] >> 4]);
+      text.push_back(hex[bytes[order[x]] & 0xF]);
+    }
+    return text;
+  }
+
+  friend constexpr bool operator==(const Guid &, const Guid &) = default;
+
+private:
+  static constexpr int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+      return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+      return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+      return c - 'A' + 10;
+    }
+    return -1;
+  }
+};
+
+static_assert(sizeof(Guid) == 16 && std::is_trivially_copyable_v<Guid>);
+
+inline constexpr Guid type_guid(const GPT_Entry &entry) {
+  return Guid::from_bytes(entry.type_guid);
+}
+
+inline constexpr Guid guid(const GPT_Entry &entry) {
+  return Guid::from_bytes(entry.guid);
+}
+
+inline constexpr bool is_used(const GPT_Entry &entry) {
+  return !type_guid(entry).is_null();
+}
+
+/**
+ * Range adapter skipping unused entries
+ */
+inline constexpr auto used = std::views::filter(
+                                [](const GPT_Entry &entry) {
+                                  return is_used(entry);
+                                });
+
+namespace literals {
+
+/**
+ * GUID literal, invalid GUIDs fail to compile
+ */
+consteval Guid operator""_guid(const char *text, std::size_t length) {
+  return Guid::parse(std::string_view(text, length)).value();
+}
+
+} // namespace literals
+
+/**
+ * Owning GPT Handle
+ */
+class Handle {
+public:
+  Handle() = default;
+
+  explicit Handle(GPT_Handle *handle) : handle_(handle) {}
+
+  Handle(Handle &&other) noexcept
+      : handle_(std::exchange(other.handle_, nullptr)) {}
+
+  Handle &operator=(Handle &&other) noexcept {
+    std::swap(handle_, other.handle_);
+    return *this;
+  }
+
+  Handle(const Handle &) = delete;
+  Handle &operator=(const Handle &) = delete;
+
+  ~Handle() {
+    if (handle_ != nullptr) {
+      gpt_close_handle(handle_);
+    }
+  }
+
+  static Handle open(const char *path,
+                      unsigned int lba_size = GPT_DEFAULT_LBA_SIZE,
+                      uint64_t offset = GPT_DEFAULT_OFFSET,
+                      bool read_only = true) {
+    return Handle(gpt_create_handle(path, lba_size, offset, read_only));
+  }
+
+  static Handle autodetect(const char *path, bool read_only = true) {
+    return Handle(gpt_create_handle_autodetect(path, read_only));
+  }
+
+  explicit operator bool() const { return handle_ != nullptr; }
+
+  GPT_Handle *get() const { return handle_; }
+
+  GPT_Handle *release() { return std::exchange(handle_, nullptr); }
+
+private:
+  GPT_Handle *handle_ = nullptr;
+};
+
+/**
+ * Owning GPT Header with all entries
+ */
+class Table {
+public:
+  Table() = default;
+
+  Table(GPT_Header *header, GPT_Entry *entries)
+      : header_(header), entries_(entries) {}
+
+  Table(Table &&other) noexcept
+      : header_(std::exchange(other.header_, nullptr)),
+        entries_(std::exchange(other.entries_, nullptr)) {}
+
+  Table &operator=(Table &&other) noexcept {
+    std::swap(header_, other.header_);
+    std::swap(entries_, other.entries_);
+    return *this;
+  }
+
+  Table(const Table &) = delete;
+  Table &operator=(const Table &) = delete;
+
+  ~Table() {
+    if (entries_ != nullptr) {
+      gpt_free_entries(entries_);
+    }
+    if (header_ != nullptr) {
+      gpt_free_header(header_);
+    }
+  }
+
+  /**
+   * Read header and all entries
+   * @param  handle GPT Handle to read from
+   * @return        returns an empty Table on error
+   */
+  static Table read(const Handle &handle) {
+    GPT_Header *header = gpt_read_header(handle.get());
+    if (header == nullptr) {
+      return Table();
+    }
+    GPT_Entry *entries = gpt_get_all_entries(handle.get(), header);
+    if (entries == nullptr) {
+      gpt_free_header(header);
+      return Table();
+    }
+    return Table(header, entries);
+  }
+
+  explicit operator bool() const { return entries_ != nullptr; }
+
+  const GPT_Header &header() const { return *header_; }
+
+  GPT_Header &header() { return *header_; }
+
+  std::span<const GPT_Entry> entries() const {
+    return {entries_, header_->entries};
+  }
+
+  std::span<GPT_Entry> entries() { return {entries_, header_->entries}; }
+
+  auto used_entries() const { return entries() | used; }
+
+  const GPT_Entry *find(const Guid &partition) const {
+    for (const GPT_Entry &entry : used_entries()) {
+      if (guid(entry) == partition) {
+        return &entry;
+      }
+    }
+    return nullptr;
+  }
+
+  /**
+   * Recalculate entries and header CRC32 checksums
+   */
+  void refresh() {
+    gpt_refresh_entries(header_, entries_);
+    gpt_refresh_crc32(header_);
+  }
+
+  /**
+   * Write entries and primary GPT Header
+   * @param  handle GPT Handle
+   * @return        returns error code
+   */
+  GPT_Error write(const Handle &handle) {
+    GPT_Error error = gpt_write_entries(handle.get(), header_, entries_);
+    if (error != GPT_SUCCESS) {
+      return error;
+    }
+    return gpt_write_header(handle.get(), header_);
+  }
+
+  GPT_Error verify(const Handle &handle) {
+    GPT_Error error = gpt_verify_header(handle.get(), header_);
+    if (error != GPT_SUCCESS) {
+      return error;
+    }
+    return gpt_verify_entries(handle.get(), header_, entries_);
+  }
+
+private:
+  GPT_Header *header_ = nullptr;
+  GPT_Entry *entries_ = nullptr;
+};
+
+} // namespace gpt
+
+template <> struct std::hash<gpt::Guid> {
+  constexpr std::size_t operator()(const gpt::Guid &guid) const {
+    return guid.hash();
+  }
+};
+
+#endif
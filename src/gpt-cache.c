@@ -0,0 +1,449 @@
+/**
+ * Copyright (c) 2017 Viktor Schneider <info@vjs.io>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "gpt-manipulator.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Every slot is a seqlock: writers make the sequence odd while they modify
+ * the slot, readers copy the slot and retry if the sequence changed. Slots
+ * are direct mapped by device key, a colliding device evicts the table.
+ * Lock owners are recorded by PID and process start time, so a lock held
+ * by a process that died is taken over. All processes sharing a cache
+ * have to run in the same PID namespace.
+ */
+
+#define GPT_CACHE_MAGIC 0x43545047
+#define GPT_CACHE_VERSION 1
+#define GPT_CACHE_RETRIES 64
+#define GPT_CACHE_LOCK_RETRIES 16
+
+#define GPT_CACHE_HEADER 1
+#define GPT_CACHE_ENTRIES 2
+
+struct GPT_Cache_Key {
+  uint64_t device;
+  uint64_t inode;
+  uint64_t size;
+  uint64_t offset;
+  uint64_t lba_size;
+};
+
+struct GPT_Cache_Slot {
+  uint64_t sequence;
+  uint32_t owner;
+  uint32_t reserved;
+  uint64_t owner_start;
+  struct GPT_Cache_Key key;
+  uint32_t state;
+  uint32_t entry_count;
+  struct GPT_Header header;
+  uint64_t entries_position;
+  uint32_t entries_crc;
+  uint32_t entries_reserved;
+  struct GPT_Entry entries[GPT_CACHE_MAX_ENTRIES];
+};
+
+struct GPT_Cache_Segment {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t slot_size;
+  uint32_t reserved;
+  struct GPT_Cache_Slot slots[];
+};
+
+struct GPT_Cache {
+  struct GPT_Cache_Segment *segment;
+  size_t size;
+  uint32_t slots;
+};
+
+struct GPT_Cache_Link {
+  struct GPT_Cache_Slot *slot;
+  struct GPT_Cache_Key key;
+};
+
+/**
+ * Start time of process pid in clock ticks since boot, 0 if unknown
+ */
+static uint64_t gpt_cache_start_time(pid_t pid) {
+  char path[32];
+  char stat[512];
+  snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    return 0;
+  }
+  size_t length = fread(stat, 1, sizeof(stat) - 1, file);
+  fclose(file);
+  stat[length] = 0;
+
+  /* command name may contain spaces, fields are counted after it */
+  char *field = strrchr(stat, ')');
+  for (int x = 0; field != NULL && x < 20; x++) {
+    field = strchr(field + 1, ' ');
+  }
+  return field == NULL ? 0 : strtoull(field + 1, NULL, 10);
+}
+
+static bool gpt_cache_owner_alive(uint32_t owner, uint64_t start) {
+  if (kill((pid_t)owner, 0) != 0 && errno == ESRCH) {
+    return false;
+  }
+  /* PID was reused if the process started after the lock was taken */
+  uint64_t current = gpt_cache_start_time((pid_t)owner);
+  return current == 0 || start == 0 || current == start;
+}
+
+struct GPT_Cache *gpt_cache_open(const char *name, uint32_t slots) {
+  if (name == NULL) {
+    name = GPT_DEFAULT_CACHE_NAME;
+  }
+  if (slots == 0) {
+    slots = GPT_DEFAULT_CACHE_SLOTS;
+  }
+
+  /* only the creator sizes the segment, others wait for it */
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd >= 0) {
+    if (ftruncate(fd, sizeof(struct GPT_Cache_Segment) +
+                        (uint64_t)slots * sizeof(struct GPT_Cache_Slot)) != 0) {
+      close(fd);
+      shm_unlink(name);
+      return NULL;
+    }
+  } else {
+    fd = shm_open(name, O_RDWR, 0600);
+    if (fd < 0) {
+      return NULL;
+    }
+  }
+
+  struct stat st;
+  for (int x = 0; x < GPT_CACHE_RETRIES; x++) {
+    if (fstat(fd, &st) != 0) {
+      close(fd);
+      return NULL;
+    }
+    if (st.st_size != 0) {
+      break;
+    }
+    sched_yield();
+  }
+  if ((uint64_t)st.st_size <
+        sizeof(struct GPT_Cache_Segment) + sizeof(struct GPT_Cache_Slot)) {
+    close(fd);
+    return NULL;
+  }
+
+  void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
+
+  struct GPT_Cache_Segment *segment = (struct GPT_Cache_Segment *)map;
+  if (__atomic_load_n(&segment->magic, __ATOMIC_ACQUIRE) == 0) {
+    /* concurrent initialization writes identical values */
+    segment->version = GPT_CACHE_VERSION;
+    segment->slot_size = sizeof(struct GPT_Cache_Slot);
+    __atomic_store_n(&segment->magic, GPT_CACHE_MAGIC, __ATOMIC_RELEASE);
+  }
+  if (segment->magic != GPT_CACHE_MAGIC ||
+      segment->version != GPT_CACHE_VERSION ||
+      segment->slot_size != sizeof(struct GPT_Cache_Slot)) {
+    munmap(map, st.st_size);
+    return NULL;
+  }
+
+  struct GPT_Cache *cache = (struct GPT_Cache *)malloc(sizeof(struct GPT_Cache));
+  if (cache == NULL) {
+    munmap(map, st.st_size);
+    return NULL;
+  }
+  cache->segment = segment;
+  cache->size = st.st_size;
+  cache->slots = (st.st_size - sizeof(struct GPT_Cache_Segment)) /
+                  sizeof(struct GPT_Cache_Slot);
+
+  return cache;
+}
+
+void gpt_cache_close(struct GPT_Cache *cache) {
+  munmap(cache->segment, cache->size);
+  free(cache);
+}
+
+bool gpt_cache_attach(struct GPT_Cache *cache, struct GPT_Handle *handle) {
+  struct stat st;
+  uint64_t size;
+  if (fstat(fileno((FILE *)handle->file), &st) != 0 ||
+      !gpt_get_disk_size(handle, &size)) {
+    return false;
+  }
+
+  struct GPT_Cache_Link *link = (struct GPT_Cache_Link *)malloc(
+                                          sizeof(struct GPT_Cache_Link));
+  if (link == NULL) {
+    return false;
+  }
+  memset(&link->key, 0, sizeof(struct GPT_Cache_Key));
+  if (S_ISBLK(st.st_mode)) {
+    link->key.device = st.st_rdev;
+  } else {
+    link->key.device = st.st_dev;
+    link->key.inode = st.st_ino;
+  }
+  link->key.size = size;
+  link->key.offset = handle->offset;
+  link->key.lba_size = handle->lba_size;
+
+  uint64_t hash = link->key.device * 0x9E3779B97F4A7C15ULL;
+  hash = (hash ^ link->key.inode) * 0xBF58476D1CE4E5B9ULL;
+  hash = (hash ^ link->key.offset) * 0x94D049BB133111EBULL;
+  link->slot = cache->segment->slots + (hash ^ (hash >> 31)) % cache->slots;
+
+  if (handle->cache != NULL) {
+    gpt_cache_detach(handle);
+  }
+  handle->cache = link;
+  return true;
+}
+
+void gpt_cache_detach(struct GPT_Handle *handle) {
+  free(handle->cache);
+  handle->cache = NULL;
+}
+
+/**
+ * Copy header or, if entries is not NULL, entries matching expected out
+ *      of the slot of handle. Returns false on a miss, sequence then holds
+ *      the slot version the miss was seen at, odd if there is none.
+ */
+static bool gpt_cache_read(struct GPT_Handle *handle, struct GPT_Header *header,
+                            struct GPT_Entry *entries,
+                            const struct GPT_Header *expected,
+                            uint64_t *sequence) {
+  struct GPT_Cache_Link *link = (struct GPT_Cache_Link *)handle->cache;
+  struct GPT_Cache_Slot *slot = link->slot;
+  uint32_t needed = entries == NULL ? GPT_CACHE_HEADER : GPT_CACHE_ENTRIES;
+
+  *sequence = 1;
+  for (int x = 0; x < GPT_CACHE_RETRIES; x++) {
+    uint64_t current = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+    if (current & 1) {
+      continue;
+    }
+
+    bool hit = (slot->state & needed) &&
+                memcmp(&slot->key, &link->key, sizeof(struct GPT_Cache_Key)) == 0;
+    if (hit && entries == NULL) {
+      memcpy(header, &slot->header, sizeof(struct GPT_Header));
+    } else if (hit) {
+      hit = slot->entry_count == expected->entries &&
+              slot->entries_crc == expected->crc32_entries &&
+              slot->entries_position == expected->position_entries;
+      if (hit) {
+        memcpy(entries, slot->entries,
+                sizeof(struct GPT_Entry) * expected->entries);
+      }
+    }
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) == current) {
+      *sequence = current;
+      return hit;
+    }
+  }
+  return false;
+}
+
+bool gpt_cache_get_header(struct GPT_Handle *handle, struct GPT_Header *header,
+                            uint64_t *sequence) {
+  return gpt_cache_read(handle, header, NULL, NULL, sequence);
+}
+
+bool gpt_cache_get_entries(struct GPT_Handle *handle, struct GPT_Header *header,
+                            struct GPT_Entry *entries, uint64_t *sequence) {
+  if (header->entries > GPT_CACHE_MAX_ENTRIES) {
+    *sequence = 1;
+    return false;
+  }
+  return gpt_cache_read(handle, NULL, entries, header, sequence);
+}
+
+static void gpt_cache_set_owner(struct GPT_Cache_Slot *slot) {
+  /* looked up again after fork */
+  static pid_t cached_pid;
+  static uint64_t cached_start;
+  pid_t pid = getpid();
+  if (__atomic_load_n(&cached_pid, __ATOMIC_ACQUIRE) != pid) {
+    __atomic_store_n(&cached_start, gpt_cache_start_time(pid), __ATOMIC_RELAXED);
+    __atomic_store_n(&cached_pid, pid, __ATOMIC_RELEASE);
+  }
+  slot->owner_start = __atomic_load_n(&cached_start, __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->owner, (uint32_t)pid, __ATOMIC_RELEASE);
+}
+
+/**
+ * Lock slot, sequence is set to the even value the unlock continues from
+ */
+static bool gpt_cache_lock(struct GPT_Cache_Slot *slot, uint64_t *sequence) {
+  for (int x = 0; x < GPT_CACHE_LOCK_RETRIES; x++) {
+    *sequence = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+    if ((*sequence & 1) == 0 &&
+        __atomic_compare_exchange_n(&slot->sequence, sequence, *sequence + 1,
+                                    false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      gpt_cache_set_owner(slot);
+      /* odd sequence has to be visible before any data is modified */
+      __atomic_thread_fence(__ATOMIC_RELEASE);
+      return true;
+    }
+    sched_yield();
+  }
+
+  /* owner 0 for another round means the holder died between locking
+   * and recording itself */
+  uint64_t locked = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+  uint32_t owner = __atomic_load_n(&slot->owner, __ATOMIC_ACQUIRE);
+  for (int x = 0; owner == 0 && x < GPT_CACHE_LOCK_RETRIES; x++) {
+    sched_yield();
+    owner = __atomic_load_n(&slot->owner, __ATOMIC_ACQUIRE);
+  }
+  if ((locked & 1) == 0 ||
+      __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != locked ||
+      (owner != 0 && gpt_cache_owner_alive(owner, slot->owner_start))) {
+    return false;
+  }
+
+  /* take over the dead owner's lock, its partial update is dropped */
+  if (!__atomic_compare_exchange_n(&slot->sequence, &locked, locked + 2,
+                                    false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+    return false;
+  }
+  gpt_cache_set_owner(slot);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  slot->state = 0;
+  *sequence = locked + 1;
+  return true;
+}
+
+static void gpt_cache_unlock(struct GPT_Cache_Slot *slot, uint64_t sequence) {
+  __atomic_store_n(&slot->owner, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * Lock slot of handle, a slot holding another device is taken over. With
+ *      expected set the slot is only locked if it is still at that version.
+ */
+static struct GPT_Cache_Slot *gpt_cache_claim(struct GPT_Handle *handle,
+                                                const uint64_t *expected,
+                                                uint64_t *sequence) {
+  struct GPT_Cache_Link *link = (struct GPT_Cache_Link *)handle->cache;
+  struct GPT_Cache_Slot *slot = link->slot;
+  if (expected != NULL) {
+    *sequence = *expected;
+    if ((*sequence & 1) != 0 ||
+        !__atomic_compare_exchange_n(&slot->sequence, sequence, *sequence + 1,
+                                      false, __ATOMIC_ACQUIRE,
+                                      __ATOMIC_RELAXED)) {
+      return NULL;
+    }
+    gpt_cache_set_owner(slot);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+  } else if (!gpt_cache_lock(slot, sequence)) {
+    return NULL;
+  }
+  if (memcmp(&slot->key, &link->key, sizeof(struct GPT_Cache_Key)) != 0) {
+    memcpy(&slot->key, &link->key, sizeof(struct GPT_Cache_Key));
+    slot->state = 0;
+  }
+  return slot;
+}
+
+void gpt_cache_publish_header(struct GPT_Handle *handle,
+                                struct GPT_Header *header,
+                                const uint64_t *expected) {
+  uint64_t sequence;
+  struct GPT_Cache_Slot *slot = gpt_cache_claim(handle, expected, &sequence);
+  if (slot == NULL) {
+    return;
+  }
+
+  /* cached entries stay valid if the new header still describes them */
+  if ((slot->state & GPT_CACHE_ENTRIES) &&
+      (slot->entry_count != header->entries ||
+       slot->entries_crc != header->crc32_entries ||
+       slot->entries_position != header->position_entries)) {
+    slot->state &= ~GPT_CACHE_ENTRIES;
+  }
+  memcpy(&slot->header, header, sizeof(struct GPT_Header));
+  slot->state |= GPT_CACHE_HEADER;
+
+  gpt_cache_unlock(slot, sequence);
+}
+
+void gpt_cache_publish_entries(struct GPT_Handle *handle,
+                                struct GPT_Header *header,
+                                struct GPT_Entry *entries,
+                                const uint64_t *expected) {
+  uint64_t sequence;
+  struct GPT_Cache_Slot *slot = gpt_cache_claim(handle, expected, &sequence);
+  if (slot == NULL) {
+    return;
+  }
+
+  if (header->entries <= GPT_CACHE_MAX_ENTRIES) {
+    memcpy(slot->entries, entries, sizeof(struct GPT_Entry) * header->entries);
+    slot->entry_count = header->entries;
+    slot->entries_crc = header->crc32_entries;
+    slot->entries_position = header->position_entries;
+    slot->state |= GPT_CACHE_ENTRIES;
+  } else {
+    slot->state &= ~GPT_CACHE_ENTRIES;
+  }
+
+  gpt_cache_unlock(slot, sequence);
+}
+
+void gpt_cache_invalidate(struct GPT_Handle *handle) {
+  struct GPT_Cache_Link *link = (struct GPT_Cache_Link *)handle->cache;
+  struct GPT_Cache_Slot *slot = link->slot;
+  uint64_t sequence;
+  if (!gpt_cache_lock(slot, &sequence)) {
+    return;
+  }
+  if (memcmp(&slot->key, &link->key, sizeof(struct GPT_Cache_Key)) == 0) {
+    slot->state = 0;
+  }
+  gpt_cache_unlock(slot, sequence);
+}
@@ -0,0 +1,273 @@
+/**
+ * Copyright (c) 2017 Viktor Schneider <info@vjs.io>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "gpt-manipulator.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+struct GPT_Discover_Job {
+  struct GPT_Table_Node *parent;
+  uint32_t entry;
+  struct GPT_Table_Node *result;
+};
+
+struct GPT_Discover_Level {
+  int fd;
+  unsigned int lba_size;
+  uint8_t signature[8];
+  struct GPT_Discover_Job *jobs;
+  size_t job_count;
+  size_t next;
+};
+
+/**
+ * Read and validate a GPT table at header_lba of a disk starting at offset,
+ *      any signature is accepted if signature is NULL
+ */
+static struct GPT_Table_Node *gpt_discover_probe(int fd, unsigned int lba_size,
+                                                  const uint8_t *signature,
+                                                  uint64_t offset,
+                                                  uint64_t header_lba,
+                                                  uint64_t lba_count) {
+  struct GPT_Header header;
+  if (!gpt_pread_header(fd, offset + header_lba * lba_size, &header) ||
+      (signature != NULL && memcmp(header.signature, signature, 8) != 0) ||
+      header.header_size < 92 || header.header_size > lba_size ||
+      !gpt_verify_crc32(&header)) {
+    return NULL;
+  }
+
+  /* entry array has to fit into the probed disk before it is read */
+  uint64_t entries_lba = ((uint64_t)header.entries * header.entry_size +
+                            lba_size - 1) / lba_size;
+  if (header.position_primary != header_lba ||
+      header.position_secondary >= lba_count ||
+      header.position_entries >= lba_count ||
+      entries_lba > lba_count - header.position_entries ||
+      header.last_partition_lba >= lba_count) {
+    return NULL;
+  }
+
+  bool valid;
+  struct GPT_Entry *entries = gpt_pread_entries(fd,
+                  offset + header.position_entries * lba_size, &header, &valid);
+  if (entries == NULL) {
+    return NULL;
+  }
+  if (!valid) {
+    free(entries);
+    return NULL;
+  }
+
+  struct GPT_Table_Node *node = (struct GPT_Table_Node *)calloc(1,
+                                            sizeof(struct GPT_Table_Node));
+  if (node == NULL) {
+    free(entries);
+    return NULL;
+  }
+  node->offset = offset;
+  node->lba_count = lba_count;
+  node->header = header;
+  node->entries = entries;
+  return node;
+}
+
+static void *gpt_discover_worker(void *data) {
+  struct GPT_Discover_Level *level = (struct GPT_Discover_Level *)data;
+  size_t x;
+  while ((x = __atomic_fetch_add(&level->next, 1, __ATOMIC_RELAXED)) <
+            level->job_count) {
+    struct GPT_Discover_Job *job = level->jobs + x;
+    struct GPT_Entry *entry = job->parent->entries + job->entry;
+    job->result = gpt_discover_probe(level->fd, level->lba_size,
+                      level->signature,
+                      job->parent->offset + entry->first_lba * level->lba_size,
+                      1, entry->last_lba - entry->first_lba + 1);
+  }
+  return NULL;
+}
+
+/**
+ * Probe all jobs of one level on at most workers threads
+ */
+static void gpt_discover_run(struct GPT_Discover_Level *level,
+                              unsigned int workers) {
+  if (workers > level->job_count) {
+    workers = level->job_count;
+  }
+
+  pthread_t *threads = (pthread_t *)malloc(sizeof(pthread_t) * workers);
+  unsigned int started = 0;
+  for (; threads != NULL && started + 1 < workers; started++) {
+    if (pthread_create(threads + started, NULL, gpt_discover_worker,
+                        level) != 0) {
+      break;
+    }
+  }
+  /* calling thread is a worker too, so a level finishes even if
+   * no thread could be started */
+  gpt_discover_worker(level);
+
+  for (unsigned int x = 0; x < started; x++) {
+    pthread_join(threads[x], NULL);
+  }
+  free(threads);
+}
+
+static bool gpt_discover_candidate(struct GPT_Table_Node *node,
+                                    struct GPT_Entry *entry) {
+  return gpt_entry_is_used(entry) &&
+          entry->first_lba >= node->header.first_partition_lba &&
+          entry->last_lba <= node->header.last_partition_lba &&
+          entry->first_lba < entry->last_lba;
+}
+
+struct GPT_Table_Node *gpt_discover_tables(struct GPT_Handle *handle,
+                                  const struct GPT_Discover_Options *options) {
+  struct GPT_Discover_Options defaults = {
+    GPT_DEFAULT_DISCOVER_DEPTH,
+    GPT_DEFAULT_DISCOVER_TABLES,
+    GPT_DEFAULT_DISCOVER_WORKERS
+  };
+  if (options == NULL) {
+    options = &defaults;
+  }
+  struct GPT_Discover_Options limits = *options;
+  if (limits.max_tables_per_level == 0) {
+    limits.max_tables_per_level = GPT_DEFAULT_DISCOVER_TABLES;
+  }
+  if (limits.workers == 0) {
+    limits.workers = GPT_DEFAULT_DISCOVER_WORKERS;
+  }
+  options = &limits;
+
+  uint64_t disk_size;
+  if (!gpt_get_disk_size(handle, &disk_size)) {
+    return NULL;
+  }
+
+  struct GPT_Discover_Level level;
+  level.fd = fileno((FILE *)handle->file);
+  level.lba_size = handle->lba_size;
+
+  /* handle may use a non standard signature, nested tables have to
+   * carry the same one as the root table */
+  struct GPT_Table_Node *root = gpt_discover_probe(level.fd, level.lba_size,
+                              NULL, 0, handle->offset / handle->lba_size,
+                              disk_size / handle->lba_size);
+  if (root == NULL) {
+    return NULL;
+  }
+  memcpy(level.signature, root->header.signature, sizeof(level.signature));
+
+  struct GPT_Table_Node **nodes = (struct GPT_Table_Node **)malloc(
+                                        sizeof(struct GPT_Table_Node *));
+  if (nodes == NULL) {
+    gpt_free_table_tree(root);
+    return NULL;
+  }
+  nodes[0] = root;
+  size_t node_count = 1;
+
+  for (unsigned int depth = 1; depth <= options->max_depth && node_count > 0;
+        depth++) {
+    /* the level limit bounds probes, so I/O and memory stay bounded too */
+    size_t job_count = 0;
+    for (size_t x = 0; x < node_count &&
+          job_count < options->max_tables_per_level; x++) {
+      for (uint32_t y = 0; y < nodes[x]->header.entries &&
+            job_count < options->max_tables_per_level; y++) {
+        if (gpt_discover_candidate(nodes[x], nodes[x]->entries + y)) {
+          job_count++;
+        }
+      }
+    }
+    if (job_count == 0) {
+      break;
+    }
+
+    level.jobs = (struct GPT_Discover_Job *)malloc(
+                            sizeof(struct GPT_Discover_Job) * job_count);
+    struct GPT_Table_Node **next = (struct GPT_Table_Node **)malloc(
+                            sizeof(struct GPT_Table_Node *) * job_count);
+    if (level.jobs == NULL || next == NULL) {
+      free(level.jobs);
+      free(next);
+      break;
+    }
+    level.job_count = 0;
+    level.next = 0;
+    for (size_t x = 0; x < node_count && level.job_count < job_count; x++) {
+      for (uint32_t y = 0; y < nodes[x]->header.entries &&
+            level.job_count < job_count; y++) {
+        if (gpt_discover_candidate(nodes[x], nodes[x]->entries + y)) {
+          level.jobs[level.job_count].parent = nodes[x];
+          level.jobs[level.job_count].entry = y;
+          level.jobs[level.job_count].result = NULL;
+          level.job_count++;
+        }
+      }
+    }
+
+    gpt_discover_run(&level, options->workers);
+
+    /* attach in entry order */
+    size_t next_count = 0;
+    for (size_t x = 0; x < level.job_count; x++) {
+      struct GPT_Discover_Job *job = level.jobs + x;
+      if (job->result == NULL) {
+        continue;
+      }
+      struct GPT_Table_Node **children = (struct GPT_Table_Node **)realloc(
+              job->parent->children,
+              sizeof(struct GPT_Table_Node *) * (job->parent->child_count + 1));
+      if (children == NULL) {
+        gpt_free_table_tree(job->result);
+        continue;
+      }
+      job->result->depth = depth;
+      job->result->parent_entry = job->entry;
+      children[job->parent->child_count++] = job->result;
+      job->parent->children = children;
+      next[next_count++] = job->result;
+    }
+
+    free(level.jobs);
+    free(nodes);
+    nodes = next;
+    node_count = next_count;
+  }
+  free(nodes);
+
+  return root;
+}
+
+void gpt_free_table_tree(struct GPT_Table_Node *root) {
+  for (uint32_t x = 0; x < root->child_count; x++) {
+    gpt_free_table_tree(root->children[x]);
+  }
+  free(root->children);
+  free(root->entries);
+  free(root);
+}
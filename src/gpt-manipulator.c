@@ -20,11 +20,17 @@
  * SOFTWARE.
  */
 
+#define _GNU_SOURCE
 #include "gpt-manipulator.h"
 #include "crc32.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 
 void gpt_copy_raw_header(struct GPT_Header *dest, struct GPT_Header_Raw *src) {
   memcpy(dest->signature, src->signature, sizeof(src->signature));
@@ -77,6 +83,42 @@ void gpt_copy_entry(struct GPT_Entry_Raw *dest, struct GPT_Entry *src) {
   dest->attributes = src->attributes;
 }
 
+void gpt_copy_raw_mbr(struct GPT_MBR *dest, struct GPT_MBR_Raw *src) {
+  memcpy(dest->boot_code, src->boot_code, sizeof(src->boot_code));
+  dest->disk_signature = src->disk_signature;
+  dest->reserved = src->reserved;
+  for (int x = 0; x < 4; x++) {
+    struct GPT_MBR_Partition *partition = dest->partitions + x;
+    partition->status = src->partitions[x].status;
+    memcpy(partition->chs_first, src->partitions[x].chs_first,
+            sizeof(partition->chs_first));
+    partition->type = src->partitions[x].type;
+    memcpy(partition->chs_last, src->partitions[x].chs_last,
+            sizeof(partition->chs_last));
+    partition->first_lba = src->partitions[x].first_lba;
+    partition->sectors = src->partitions[x].sectors;
+  }
+  dest->signature = src->signature;
+}
+
+void gpt_copy_mbr(struct GPT_MBR_Raw *dest, struct GPT_MBR *src) {
+  memcpy(dest->boot_code, src->boot_code, sizeof(dest->boot_code));
+  dest->disk_signature = src->disk_signature;
+  dest->reserved = src->reserved;
+  for (int x = 0; x < 4; x++) {
+    struct GPT_MBR_Partition_Raw *partition = dest->partitions + x;
+    partition->status = src->partitions[x].status;
+    memcpy(partition->chs_first, src->partitions[x].chs_first,
+            sizeof(partition->chs_first));
+    partition->type = src->partitions[x].type;
+    memcpy(partition->chs_last, src->partitions[x].chs_last,
+            sizeof(partition->chs_last));
+    partition->first_lba = src->partitions[x].first_lba;
+    partition->sectors = src->partitions[x].sectors;
+  }
+  dest->signature = src->signature;
+}
+
 bool gpt_write_padding(struct GPT_Handle *handle, int padding) {
   uint8_t *buffer;
   int buffer_size;
@@ -118,6 +160,7 @@ struct GPT_Handle *gpt_create_handle(const char *path, unsigned int lba_size,
   }
 
   struct GPT_Handle *handle = (struct GPT_Handle *)malloc(sizeof(struct GPT_Handle));
+  handle->cache = NULL;
 
   if (read_only) {
     handle->file = fopen(path, "r");
@@ -163,23 +206,197 @@ struct GPT_Handle *gpt_create_handle_with_signature(const char *path,
   return handle;
 }
 
+/**
+ * Check for a valid header of given LBA size at LBA lba within buffer,
+ *      which starts at byte offset of the device
+ */
+static bool gpt_detect_header(const uint8_t *buffer, uint64_t offset,
+                                size_t length, unsigned int lba_size,
+                                uint64_t lba, const char *signature) {
+  if (lba * lba_size < offset ||
+      lba * lba_size - offset + sizeof(struct GPT_Header_Raw) > length) {
+    return false;
+  }
+
+  struct GPT_Header_Raw data;
+  memcpy(&data, buffer + (lba * lba_size - offset),
+          sizeof(struct GPT_Header_Raw));
+  if (memcmp(data.signature, signature, sizeof(data.signature)) != 0 ||
+      data.position_primary != lba || data.header_size < 92 ||
+      data.header_size > lba_size) {
+    return false;
+  }
+
+  struct GPT_Header header;
+  gpt_copy_raw_header(&header, &data);
+  return gpt_verify_crc32(&header);
+}
+
+struct GPT_Handle *gpt_create_handle_autodetect(const char *path,
+                                                  bool read_only) {
+  return gpt_create_handle_autodetect_with_signature(path,
+                                    GPT_DEFAULT_SIGNATURE, read_only);
+}
+
+struct GPT_Handle *gpt_create_handle_autodetect_with_signature(
+                                                    const char *path,
+                                                    const char *signature,
+                                                    bool read_only) {
+  struct GPT_Handle *handle = gpt_create_handle(path, GPT_DEFAULT_LBA_SIZE,
+                                                GPT_DEFAULT_OFFSET, read_only);
+  if (handle == NULL) {
+    return NULL;
+  }
+  int fd = fileno((FILE *)handle->file);
+
+  /* sector sizes reported by block devices are tried first */
+  unsigned int sizes[4];
+  int size_count = 0;
+  int logical = 0, physical = 0;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISBLK(st.st_mode)) {
+    if (ioctl(fd, BLKSSZGET, &logical) == 0 && logical >= 512 &&
+        logical <= GPT_DETECT_SIZE / 2) {
+      sizes[size_count++] = logical;
+    }
+    if (ioctl(fd, BLKPBSZGET, &physical) == 0 && physical != logical &&
+        physical >= 512 && physical <= GPT_DETECT_SIZE / 2) {
+      sizes[size_count++] = physical;
+    }
+  }
+  for (unsigned int size = 512; size <= 4096; size *= 8) {
+    bool known = false;
+    for (int x = 0; x < size_count; x++) {
+      known |= sizes[x] == size;
+    }
+    if (!known) {
+      sizes[size_count++] = size;
+    }
+  }
+
+  uint8_t *buffer;
+  if (posix_memalign((void **)&buffer, 4096, GPT_DETECT_SIZE) != 0) {
+    gpt_close_handle(handle);
+    return NULL;
+  }
+
+  ssize_t length = pread(fd, buffer, GPT_DETECT_SIZE, 0);
+  for (int x = 0; length > 0 && x < size_count; x++) {
+    if (gpt_detect_header(buffer, 0, length, sizes[x], 1, signature)) {
+      handle->lba_size = sizes[x];
+      handle->offset = sizes[x];
+      free(buffer);
+      return handle;
+    }
+  }
+
+  /* primary header is missing or damaged, look for the secondary to
+   * detect the LBA size, the handle still refers to the primary */
+  uint64_t disk_size;
+  uint64_t tail = GPT_DETECT_SIZE / 2;
+  if (gpt_get_disk_size(handle, &disk_size) && disk_size >= 2 * tail) {
+    length = pread(fd, buffer, tail, disk_size - tail);
+    for (int x = 0; length == (ssize_t)tail && x < size_count; x++) {
+      if (disk_size % sizes[x] == 0 &&
+          gpt_detect_header(buffer, disk_size - tail, length, sizes[x],
+                            disk_size / sizes[x] - 1, signature)) {
+        handle->lba_size = sizes[x];
+        handle->offset = sizes[x];
+        free(buffer);
+        return handle;
+      }
+    }
+  }
+
+  free(buffer);
+  gpt_close_handle(handle);
+  return NULL;
+}
+
+struct GPT_Header *gpt_read_secondary_header(struct GPT_Handle *handle) {
+  uint64_t disk_size;
+  if (!gpt_get_disk_size(handle, &disk_size) ||
+      disk_size < 2 * handle->lba_size) {
+    return NULL;
+  }
+
+  struct GPT_Header *header = (struct GPT_Header *)malloc(
+                                          sizeof(struct GPT_Header));
+  if (header == NULL) {
+    return NULL;
+  }
+  if (!gpt_pread_header(fileno((FILE *)handle->file),
+                        disk_size / handle->lba_size * handle->lba_size -
+                        handle->lba_size, header)) {
+    free(header);
+    return NULL;
+  }
+  return header;
+}
+
 void gpt_close_handle(struct GPT_Handle *handle) {
+  if (handle->cache != NULL) {
+    gpt_cache_detach(handle);
+  }
   fclose((FILE *)handle->file);
   free(handle);
 }
 
 struct GPT_Header *gpt_read_header(struct GPT_Handle *handle) {
-  if (fseek((FILE *)handle->file, handle->offset, SEEK_SET) != 0) {
+  uint64_t sequence = 1;
+  if (handle->cache != NULL) {
+    struct GPT_Header *header = (struct GPT_Header *)malloc(
+                                          sizeof(struct GPT_Header));
+    if (header != NULL && gpt_cache_get_header(handle, header, &sequence)) {
+      return header;
+    }
+    free(header);
+  }
+
+  /* a header published by a writer since the miss is newer than ours */
+  struct GPT_Header *header = gpt_read_header_with_mbr(handle, NULL);
+  if (header != NULL && handle->cache != NULL && gpt_verify_crc32(header)) {
+    gpt_cache_publish_header(handle, header, &sequence);
+  }
+  return header;
+}
+
+struct GPT_Header *gpt_read_header_with_mbr(struct GPT_Handle *handle,
+                                              struct GPT_MBR *mbr) {
+  /* with MBR everything from LBA 0 up to the header is read at once */
+  uint64_t start = handle->offset;
+  if (mbr != NULL) {
+    memset(mbr, 0, sizeof(struct GPT_MBR));
+    if (handle->offset <= GPT_MAX_PREFIX_SIZE) {
+      start = 0;
+    }
+  }
+
+  size_t length = handle->offset - start + sizeof(struct GPT_Header_Raw);
+  uint8_t *data = (uint8_t *)malloc(length);
+  if (data == NULL) {
     return NULL;
   }
 
-  struct GPT_Header_Raw data;
-  if (fread(&data, sizeof(struct GPT_Header_Raw), 1, (FILE *)handle->file) != 1) {
+  if (fseek((FILE *)handle->file, start, SEEK_SET) != 0 ||
+      fread(data, length, 1, (FILE *)handle->file) != 1) {
+    free(data);
     return NULL;
   }
 
   struct GPT_Header *header = (struct GPT_Header *)malloc(sizeof(struct GPT_Header));
-  gpt_copy_raw_header(header, &data);
+  if (header == NULL) {
+    free(data);
+    return NULL;
+  }
+  gpt_copy_raw_header(header, (struct GPT_Header_Raw *)(data + length -
+                                              sizeof(struct GPT_Header_Raw)));
+
+  if (mbr != NULL && start == 0 &&
+      handle->offset >= sizeof(struct GPT_MBR_Raw)) {
+    gpt_copy_raw_mbr(mbr, (struct GPT_MBR_Raw *)data);
+  }
+  free(data);
 
   return header;
 }
@@ -214,7 +431,7 @@ struct GPT_Entry *gpt_get_entry(struct GPT_Handle *handle,
   return entry;
 }
 
-struct GPT_Entry *gpt_get_all_entries(struct GPT_Handle *handle,
+static struct GPT_Entry *gpt_read_all_entries(struct GPT_Handle *handle,
                         struct GPT_Header *header) {
   if (fseek((FILE *)handle->file, header->position_entries *
               handle->lba_size, SEEK_SET) != 0) {
@@ -253,6 +470,29 @@ struct GPT_Entry *gpt_get_all_entries(struct GPT_Handle *handle,
   return entries;
 }
 
+struct GPT_Entry *gpt_get_all_entries(struct GPT_Handle *handle,
+                        struct GPT_Header *header) {
+  if (handle->cache == NULL) {
+    return gpt_read_all_entries(handle, header);
+  }
+
+  uint64_t sequence = 1;
+  struct GPT_Entry *entries = (struct GPT_Entry *)malloc(
+                        sizeof(struct GPT_Entry) * header->entries);
+  if (entries != NULL &&
+      gpt_cache_get_entries(handle, header, entries, &sequence)) {
+    return entries;
+  }
+  free(entries);
+
+  /* only entries matching their checksum are shared with other processes */
+  entries = gpt_read_all_entries(handle, header);
+  if (entries != NULL && gpt_verify_entries_crc32(header, entries)) {
+    gpt_cache_publish_entries(handle, header, entries, &sequence);
+  }
+  return entries;
+}
+
 void gpt_free_entries(struct GPT_Entry *entries) {
   free(entries);
 }
@@ -279,12 +519,114 @@ void gpt_refresh_crc32(struct GPT_Header *header) {
 
 void gpt_refresh_entries(struct GPT_Header *header, struct GPT_Entry *entries) {
   header->crc32_entries = 0;
-  crc32(entries, header->entries * header->entry_size, &header->crc32_entries);
+  if (header->entry_size == sizeof(struct GPT_Entry_Raw)) {
+    crc32(entries, header->entries * header->entry_size, &header->crc32_entries);
+    return;
+  }
+
+  /* other entry sizes are checksummed like gpt_write_entries stores them,
+   * truncated or padded with zeros */
+  static const uint8_t zero[256];
+  uint32_t length = header->entry_size < sizeof(struct GPT_Entry_Raw) ?
+                      header->entry_size : sizeof(struct GPT_Entry_Raw);
+  for (uint32_t x = 0; x < header->entries; x++) {
+    crc32(entries + x, length, &header->crc32_entries);
+    for (uint32_t padding = header->entry_size - length; padding > 0;) {
+      uint32_t chunk = padding > sizeof(zero) ? sizeof(zero) : padding;
+      crc32(zero, chunk, &header->crc32_entries);
+      padding -= chunk;
+    }
+  }
 }
 
-enum GPT_Error gpt_write_header(struct GPT_Handle *handle,
-                                    struct GPT_Header *header) {
-  if (fseek((FILE *)handle->file, handle->offset, SEEK_SET) != 0) {
+enum GPT_Error gpt_sort_entries(struct GPT_Header *header,
+                                  struct GPT_Entry *entries,
+                                  uint32_t *permutation) {
+  uint32_t count = header->entries;
+  /* one scratch buffer for keys and two index arrays */
+  uint8_t *scratch = (uint8_t *)malloc((size_t)count *
+                        (sizeof(uint64_t) + 2 * sizeof(uint32_t)));
+  if (scratch == NULL && count != 0) {
+    return GPT_ALLOCATION_ERROR;
+  }
+  uint64_t *keys = (uint64_t *)scratch;
+  uint32_t *order = (uint32_t *)(keys + count);
+  uint32_t *swap = order + count;
+
+  /* used entries first, unused entries keep their order behind them */
+  uint32_t used = 0, unused = count;
+  for (uint32_t x = 0; x < count; x++) {
+    if (gpt_entry_is_used(entries + x)) {
+      keys[x] = entries[x].first_lba;
+      order[used++] = x;
+    }
+  }
+  for (uint32_t x = count; x-- > 0;) {
+    if (!gpt_entry_is_used(entries + x)) {
+      order[--unused] = x;
+    }
+  }
+
+  /* LSD radix sort of used entries, bytes equal for all keys are skipped */
+  uint32_t histogram[8][256];
+  memset(histogram, 0, sizeof(histogram));
+  for (uint32_t x = 0; x < used; x++) {
+    for (int byte = 0; byte < 8; byte++) {
+      histogram[byte][(keys[order[x]] >> (8 * byte)) & 0xFF]++;
+    }
+  }
+  uint64_t first = used != 0 ? keys[order[0]] : 0;
+  for (int byte = 0; byte < 8; byte++) {
+    if (histogram[byte][(first >> (8 * byte)) & 0xFF] == used) {
+      continue;
+    }
+
+    uint32_t offset = 0;
+    for (int x = 0; x < 256; x++) {
+      uint32_t size = histogram[byte][x];
+      histogram[byte][x] = offset;
+      offset += size;
+    }
+    for (uint32_t x = 0; x < used; x++) {
+      swap[histogram[byte][(keys[order[x]] >> (8 * byte)) & 0xFF]++] = order[x];
+    }
+    memcpy(order, swap, sizeof(uint32_t) * used);
+  }
+
+  if (permutation != NULL) {
+    for (uint32_t x = 0; x < count; x++) {
+      permutation[order[x]] = x;
+    }
+  }
+
+  /* apply order in place by following its cycles */
+  struct GPT_Entry cache;
+  for (uint32_t x = 0; x < count; x++) {
+    if (order[x] == x) {
+      continue;
+    }
+    memcpy(&cache, entries + x, sizeof(struct GPT_Entry));
+    uint32_t position = x;
+    while (order[position] != x) {
+      memcpy(entries + position, entries + order[position],
+              sizeof(struct GPT_Entry));
+      uint32_t next = order[position];
+      order[position] = position;
+      position = next;
+    }
+    memcpy(entries + position, &cache, sizeof(struct GPT_Entry));
+    order[position] = position;
+  }
+  free(scratch);
+
+  gpt_refresh_entries(header, entries);
+  gpt_refresh_crc32(header);
+  return GPT_SUCCESS;
+}
+
+enum GPT_Error gpt_write_header_at(struct GPT_Handle *handle,
+                                    struct GPT_Header *header, uint64_t lba) {
+  if (fseek((FILE *)handle->file, handle->lba_size * lba, SEEK_SET) != 0) {
     return GPT_SEEK_ERROR;
   }
 
@@ -307,10 +649,75 @@ enum GPT_Error gpt_write_header(struct GPT_Handle *handle,
   return GPT_SUCCESS;
 }
 
-enum GPT_Error gpt_write_entries(struct GPT_Handle *handle,
-                                    struct GPT_Header *header,
-                                    struct GPT_Entry *entries) {
-  if (fseek((FILE *)handle->file, handle->offset + handle->lba_size, SEEK_SET) != 0) {
+enum GPT_Error gpt_write_header(struct GPT_Handle *handle,
+                                    struct GPT_Header *header) {
+  enum GPT_Error error = gpt_write_header_at(handle, header,
+                                      handle->offset / handle->lba_size);
+  if (error == GPT_SUCCESS && handle->cache != NULL) {
+    gpt_cache_publish_header(handle, header, NULL);
+  }
+  return error;
+}
+
+enum GPT_Error gpt_write_header_with_mbr(struct GPT_Handle *handle,
+                                            struct GPT_Header *header,
+                                            struct GPT_MBR *mbr) {
+  if (mbr == NULL) {
+    return gpt_write_header(handle, header);
+  }
+
+  /* header right behind LBA 0 is written together with the MBR */
+  if (handle->offset != handle->lba_size) {
+    enum GPT_Error error = gpt_write_mbr(handle, mbr);
+    if (error != GPT_SUCCESS) {
+      return error;
+    }
+    return gpt_write_header(handle, header);
+  }
+
+  size_t header_size = header->header_size > sizeof(struct GPT_Header_Raw) ?
+                        header->header_size : sizeof(struct GPT_Header_Raw);
+  size_t length = handle->lba_size + header_size;
+  uint8_t *data = (uint8_t *)calloc(1, length);
+  if (data == NULL) {
+    return GPT_ALLOCATION_ERROR;
+  }
+  gpt_copy_mbr((struct GPT_MBR_Raw *)data, mbr);
+  gpt_copy_header((struct GPT_Header_Raw *)(data + handle->lba_size), header);
+
+  enum GPT_Error error = GPT_SUCCESS;
+  if (fseek((FILE *)handle->file, 0, SEEK_SET) != 0) {
+    error = GPT_SEEK_ERROR;
+  } else if (fwrite(data, length, 1, (FILE *)handle->file) != 1 ||
+              fflush((FILE *)handle->file) != 0) {
+    error = GPT_WRITE_ERROR;
+  }
+  free(data);
+
+  if (error == GPT_SUCCESS && handle->cache != NULL) {
+    gpt_cache_publish_header(handle, header, NULL);
+  }
+  return error;
+}
+
+enum GPT_Error gpt_write_mbr(struct GPT_Handle *handle, struct GPT_MBR *mbr) {
+  struct GPT_MBR_Raw data;
+  gpt_copy_mbr(&data, mbr);
+
+  if (fseek((FILE *)handle->file, 0, SEEK_SET) != 0) {
+    return GPT_SEEK_ERROR;
+  }
+  if (fwrite(&data, sizeof(struct GPT_MBR_Raw), 1, (FILE *)handle->file) != 1 ||
+      fflush((FILE *)handle->file) != 0) {
+    return GPT_WRITE_ERROR;
+  }
+  return GPT_SUCCESS;
+}
+
+enum GPT_Error gpt_write_entries_at(struct GPT_Handle *handle,
+                                      struct GPT_Header *header,
+                                      struct GPT_Entry *entries, uint64_t lba) {
+  if (fseek((FILE *)handle->file, handle->lba_size * lba, SEEK_SET) != 0) {
     return GPT_SEEK_ERROR;
   }
 
@@ -354,48 +761,54 @@ enum GPT_Error gpt_write_entries(struct GPT_Handle *handle,
   return GPT_SUCCESS;
 }
 
-
-enum GPT_Error gpt_write_secondary_header(struct GPT_Handle *handle,
-                                            struct GPT_Header *header) {
-  if (fseek((FILE *)handle->file,
-              handle->lba_size * header->position_secondary, SEEK_SET) != 0) {
-    return GPT_SEEK_ERROR;
+enum GPT_Error gpt_write_entries(struct GPT_Handle *handle,
+                                    struct GPT_Header *header,
+                                    struct GPT_Entry *entries) {
+  enum GPT_Error error = gpt_write_entries_at(handle, header, entries,
+                                handle->offset / handle->lba_size + 1);
+  /* header is published once gpt_write_header stored it */
+  if (error == GPT_SUCCESS && handle->cache != NULL) {
+    gpt_cache_publish_entries(handle, header, entries, NULL);
   }
+  return error;
+}
 
-  struct GPT_Header_Raw data;
-  gpt_copy_header(&data, header);
 
-  if (fwrite(&data, sizeof(struct GPT_Header_Raw), 1, (FILE *)handle->file) != 1) {
-    return GPT_WRITE_ERROR;
-  }
+enum GPT_Error gpt_write_secondary_header(struct GPT_Handle *handle,
+                                            struct GPT_Header *header) {
+  return gpt_write_header_at(handle, header, header->position_secondary);
+}
 
-  int padding = header->header_size - sizeof(struct GPT_Header_Raw);
-  if (padding > 0 && !gpt_write_padding(handle, padding)) {
-    return GPT_WRITE_ERROR;
-  }
+bool gpt_verify_crc32(struct GPT_Header *header) {
+  uint32_t crc32 = header->crc32_header;
 
-  if (fflush((FILE *)handle->file) != 0) {
-    return GPT_WRITE_ERROR;
+  gpt_refresh_crc32(header);
+  if (header->crc32_header != crc32) {
+    header->crc32_header = crc32;
+    return false;
   }
+  return true;
+}
 
-  return GPT_SUCCESS;
+bool gpt_verify_entries_crc32(struct GPT_Header *header,
+                                struct GPT_Entry *entries) {
+  struct GPT_Header copy;
+  memcpy(&copy, header, sizeof(struct GPT_Header));
+  gpt_refresh_entries(&copy, entries);
+  return copy.crc32_entries == header->crc32_entries;
 }
 
 enum GPT_Error gpt_verify_header(struct GPT_Handle *handle,
                                   struct GPT_Header *header) {
-  uint32_t crc32 = header->crc32_header;
-
-  gpt_refresh_crc32(header);
-  if (header->crc32_header != crc32) {
-    header->crc32_header = crc32;
+  if (!gpt_verify_crc32(header)) {
     return GPT_CRC32_MISMATCH;
   }
 
-  if (header->header_size < 92 || header->header_size < handle->lba_size) {
+  if (header->header_size < 92 || header->header_size > handle->lba_size) {
     return GPT_BAD_HEADER_SIZE;
   }
 
-  if (header->position_primary < header->first_partition_lba) {
+  if (header->position_primary >= header->first_partition_lba) {
     return GPT_BAD_PRIMARY_POSITION;
   }
 
@@ -407,20 +820,532 @@ enum GPT_Error gpt_verify_header(struct GPT_Handle *handle,
     return GPT_BAD_ENTRIES_POSITION;
   }
 
-  uint64_t last_entry_lba = header->position_entries +
-                                    (header->entries * header->entry_size +
-                                    handle->lba_size - 1) / handle->lba_size;
-  if (header->first_partition_lba <= last_entry_lba) {
+  /* first LBA behind the entries */
+  uint64_t end_entry_lba = header->position_entries +
+                              ((uint64_t)header->entries * header->entry_size +
+                              handle->lba_size - 1) / handle->lba_size;
+  if (header->first_partition_lba < end_entry_lba) {
     return GPT_BAD_PARTITION_POSITION;
   }
 
-  if (header->first_partition_lba <= header->last_partition_lba) {
+  if (header->first_partition_lba > header->last_partition_lba) {
     return GPT_BAD_PARTITION_POSITION;
   }
 
-  if (header->position_secondary <= header->position_primary) {
+  if (header->position_secondary <= header->position_primary ||
+      header->position_secondary <= header->last_partition_lba) {
     return GPT_BAD_SECONDARY_POSITION;
   }
 
   return GPT_SUCCESS;
 }
+
+static int gpt_compare_entries(const void *a, const void *b) {
+  uint64_t first = (*(struct GPT_Entry * const *)a)->first_lba;
+  uint64_t second = (*(struct GPT_Entry * const *)b)->first_lba;
+  return first < second ? -1 : first > second;
+}
+
+enum GPT_Error gpt_verify_entries(struct GPT_Handle *handle,
+                              struct GPT_Header *header,
+                              struct GPT_Entry *entries) {
+  /* handle keeps the signature in line with the other verify functions */
+  (void)handle;
+  if (!gpt_verify_entries_crc32(header, entries)) {
+    return GPT_CRC32_MISMATCH;
+  }
+
+  struct GPT_Entry **used = (struct GPT_Entry **)malloc(
+                            sizeof(struct GPT_Entry *) * header->entries);
+  if (used == NULL) {
+    return GPT_ALLOCATION_ERROR;
+  }
+
+  uint32_t count = 0;
+  for (uint32_t x = 0; x < header->entries; x++) {
+    if (!gpt_entry_is_used(entries + x)) {
+      continue;
+    }
+    if (entries[x].first_lba < header->first_partition_lba ||
+        entries[x].last_lba > header->last_partition_lba ||
+        entries[x].first_lba > entries[x].last_lba) {
+      free(used);
+      return GPT_BAD_PARTITION_POSITION;
+    }
+    used[count++] = entries + x;
+  }
+
+  /* partitions must not overlap */
+  qsort(used, count, sizeof(struct GPT_Entry *), gpt_compare_entries);
+  for (uint32_t x = 1; x < count; x++) {
+    if (used[x]->first_lba <= used[x - 1]->last_lba) {
+      free(used);
+      return GPT_BAD_PARTITION_POSITION;
+    }
+  }
+  free(used);
+
+  return GPT_SUCCESS;
+}
+
+enum GPT_Error gpt_verify_scondary_header(struct GPT_Handle *handle,
+                                              struct GPT_Header *header) {
+  int fd = fileno((FILE *)handle->file);
+  struct GPT_Header secondary;
+  if (!gpt_pread_header(fd, header->position_secondary * handle->lba_size,
+                        &secondary)) {
+    return GPT_READ_ERROR;
+  }
+
+  if (!gpt_verify_crc32(&secondary)) {
+    return GPT_CRC32_MISMATCH;
+  }
+
+  if (secondary.position_primary != header->position_secondary ||
+      secondary.position_secondary != header->position_primary) {
+    return GPT_BAD_SECONDARY_POSITION;
+  }
+
+  if (secondary.position_entries <= secondary.last_partition_lba ||
+      secondary.position_entries >= secondary.position_primary) {
+    return GPT_BAD_ENTRIES_POSITION;
+  }
+
+  if (memcmp(secondary.signature, header->signature, 8) != 0 ||
+      memcmp(secondary.guid, header->guid, 16) != 0 ||
+      secondary.revision != header->revision ||
+      secondary.first_partition_lba != header->first_partition_lba ||
+      secondary.last_partition_lba != header->last_partition_lba ||
+      secondary.entries != header->entries ||
+      secondary.entry_size != header->entry_size ||
+      secondary.crc32_entries != header->crc32_entries) {
+    return GPT_SECONDARY_MISMATCH;
+  }
+
+  bool valid;
+  struct GPT_Entry *entries = gpt_pread_entries(fd,
+                secondary.position_entries * handle->lba_size, &secondary, &valid);
+  if (entries == NULL) {
+    return GPT_READ_ERROR;
+  }
+  free(entries);
+
+  return valid ? GPT_SUCCESS : GPT_CRC32_MISMATCH;
+}
+
+bool gpt_get_disk_size(struct GPT_Handle *handle, uint64_t *size) {
+  int fd = fileno((FILE *)handle->file);
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    return false;
+  }
+
+  if (S_ISBLK(st.st_mode)) {
+    return ioctl(fd, BLKGETSIZE64, size) == 0;
+  }
+
+  *size = st.st_size;
+  return true;
+}
+
+bool gpt_zero_range(struct GPT_Handle *handle, uint64_t offset,
+                        uint64_t length) {
+  if (length == 0) {
+    return true;
+  }
+  if (fflush((FILE *)handle->file) != 0) {
+    return false;
+  }
+
+  /* deallocate instead of writing zeros, so sparse images stay sparse */
+  if (fallocate(fileno((FILE *)handle->file),
+                FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                offset, length) == 0) {
+    return true;
+  }
+
+  if (fseek((FILE *)handle->file, offset, SEEK_SET) != 0) {
+    return false;
+  }
+  for (; length > 0x100000; length -= 0x100000) {
+    if (!gpt_write_padding(handle, 0x100000)) {
+      return false;
+    }
+  }
+  return gpt_write_padding(handle, length);
+}
+
+enum GPT_Error gpt_sync(struct GPT_Handle *handle) {
+  if (fflush((FILE *)handle->file) != 0) {
+    return GPT_WRITE_ERROR;
+  }
+  if (fsync(fileno((FILE *)handle->file)) != 0) {
+    return GPT_SYNC_ERROR;
+  }
+  return GPT_SUCCESS;
+}
+
+void gpt_make_secondary_header(struct GPT_Header *dest,
+                                struct GPT_Header *src, uint64_t entries_lba) {
+  memcpy(dest, src, sizeof(struct GPT_Header));
+  dest->position_primary = src->position_secondary;
+  dest->position_secondary = src->position_primary;
+  dest->position_entries = entries_lba;
+  gpt_refresh_crc32(dest);
+}
+
+enum GPT_Error gpt_create_table(struct GPT_Handle *handle, uint64_t lba_count,
+                                  uint32_t entries, const uint8_t *guid) {
+  uint64_t disk_size;
+  if (entries == 0 || !gpt_get_disk_size(handle, &disk_size)) {
+    return GPT_BAD_DISK_SIZE;
+  }
+  if (lba_count == 0) {
+    lba_count = disk_size / handle->lba_size;
+  }
+
+  uint64_t entry_lbas = ((uint64_t)entries * GPT_DEFAULT_ENTRY_SIZE +
+                          handle->lba_size - 1) / handle->lba_size;
+
+  struct GPT_Header header;
+  memcpy(header.signature, GPT_DEFAULT_SIGNATURE, sizeof(header.signature));
+  header.revision = GPT_REVISION;
+  header.header_size = sizeof(struct GPT_Header_Raw);
+  header.position_primary = handle->offset / handle->lba_size;
+  header.position_entries = header.position_primary + 1;
+  header.first_partition_lba = header.position_entries + entry_lbas;
+  header.position_secondary = lba_count - 1;
+  header.last_partition_lba = header.position_secondary - entry_lbas - 1;
+  header.entries = entries;
+  header.entry_size = GPT_DEFAULT_ENTRY_SIZE;
+
+  if (lba_count < 2 * entry_lbas + 3 ||
+      header.last_partition_lba < header.first_partition_lba) {
+    return GPT_BAD_DISK_SIZE;
+  }
+
+  if (guid != NULL) {
+    memcpy(header.guid, guid, sizeof(header.guid));
+  } else {
+    FILE *random = fopen("/dev/urandom", "r");
+    if (random == NULL) {
+      return GPT_ALLOCATION_ERROR;
+    }
+    size_t length = fread(header.guid, sizeof(header.guid), 1, random);
+    fclose(random);
+    if (length != 1) {
+      return GPT_ALLOCATION_ERROR;
+    }
+    /* random GUID, version 4 */
+    header.guid[7] = (header.guid[7] & 0x0F) | 0x40;
+    header.guid[8] = (header.guid[8] & 0x3F) | 0x80;
+  }
+
+  struct GPT_Entry *empty = (struct GPT_Entry *)calloc(entries,
+                                                  sizeof(struct GPT_Entry));
+  if (empty == NULL) {
+    return GPT_ALLOCATION_ERROR;
+  }
+  gpt_refresh_entries(&header, empty);
+  gpt_refresh_crc32(&header);
+
+  /* grow image without writing data, block devices have a fixed size */
+  if (lba_count * handle->lba_size > disk_size) {
+    if (fflush((FILE *)handle->file) != 0 ||
+        ftruncate(fileno((FILE *)handle->file),
+                  lba_count * handle->lba_size) != 0) {
+      free(empty);
+      return GPT_BAD_DISK_SIZE;
+    }
+  }
+
+  uint64_t secondary_entries = header.last_partition_lba + 1;
+  if (!gpt_zero_range(handle, handle->offset,
+              (header.first_partition_lba - header.position_primary) *
+              handle->lba_size) ||
+      !gpt_zero_range(handle, secondary_entries * handle->lba_size,
+              (lba_count - secondary_entries) * handle->lba_size)) {
+    free(empty);
+    return GPT_WRITE_ERROR;
+  }
+
+  struct GPT_Header secondary;
+  gpt_make_secondary_header(&secondary, &header, secondary_entries);
+
+  enum GPT_Error error;
+  if ((error = gpt_write_entries_at(handle, &header, empty,
+                                    secondary_entries)) != GPT_SUCCESS ||
+      (error = gpt_write_header_at(handle, &secondary,
+                                   secondary.position_primary)) != GPT_SUCCESS ||
+      (error = gpt_write_entries_at(handle, &header, empty,
+                                    header.position_entries)) != GPT_SUCCESS) {
+    free(empty);
+    return error;
+  }
+  free(empty);
+
+  /* fresh protective MBR is written together with the primary header */
+  struct GPT_MBR mbr;
+  struct GPT_MBR *protective = NULL;
+  if (header.position_primary == 1) {
+    memset(&mbr, 0, sizeof(struct GPT_MBR));
+    gpt_set_protective_mbr(&mbr, &header, false);
+    protective = &mbr;
+  }
+
+  if ((error = gpt_write_header_with_mbr(handle, &header,
+                                          protective)) != GPT_SUCCESS) {
+    return error;
+  }
+  return gpt_sync(handle);
+}
+
+enum GPT_Error gpt_relocate_secondary(struct GPT_Handle *handle,
+                                        struct GPT_Header *header,
+                                        struct GPT_Entry *entries,
+                                        uint64_t lba_count) {
+  uint64_t disk_size;
+  if (!gpt_get_disk_size(handle, &disk_size)) {
+    return GPT_BAD_DISK_SIZE;
+  }
+  if (lba_count == 0) {
+    lba_count = disk_size / handle->lba_size;
+  }
+
+  uint64_t entry_lbas = ((uint64_t)header->entries * header->entry_size +
+                          handle->lba_size - 1) / handle->lba_size;
+  if (lba_count < entry_lbas + 2) {
+    return GPT_BAD_DISK_SIZE;
+  }
+
+  struct GPT_Header updated;
+  memcpy(&updated, header, sizeof(struct GPT_Header));
+  updated.position_secondary = lba_count - 1;
+  updated.last_partition_lba = updated.position_secondary - entry_lbas - 1;
+
+  if (updated.last_partition_lba < updated.first_partition_lba ||
+      updated.position_secondary <= updated.position_primary) {
+    return GPT_BAD_DISK_SIZE;
+  }
+  for (uint32_t x = 0; x < header->entries; x++) {
+    if (entries[x].last_lba > updated.last_partition_lba) {
+      return GPT_BAD_PARTITION_POSITION;
+    }
+  }
+  gpt_refresh_crc32(&updated);
+
+  if (lba_count * handle->lba_size > disk_size) {
+    if (fflush((FILE *)handle->file) != 0 ||
+        ftruncate(fileno((FILE *)handle->file),
+                  lba_count * handle->lba_size) != 0) {
+      return GPT_BAD_DISK_SIZE;
+    }
+  }
+
+  uint64_t secondary_entries = updated.last_partition_lba + 1;
+  if (!gpt_zero_range(handle, secondary_entries * handle->lba_size,
+                      (lba_count - secondary_entries) * handle->lba_size)) {
+    return GPT_WRITE_ERROR;
+  }
+
+  struct GPT_Header secondary;
+  gpt_make_secondary_header(&secondary, &updated, secondary_entries);
+
+  /* new secondary table has to be on disk before the primary refers to it */
+  enum GPT_Error error;
+  if ((error = gpt_write_entries_at(handle, &updated, entries,
+                                    secondary_entries)) != GPT_SUCCESS ||
+      (error = gpt_write_header_at(handle, &secondary,
+                                   secondary.position_primary)) != GPT_SUCCESS ||
+      (error = gpt_sync(handle)) != GPT_SUCCESS) {
+    return error;
+  }
+
+  /* protective MBR is updated together with the primary header,
+   * hybrid partitions are kept */
+  struct GPT_MBR mbr;
+  struct GPT_MBR *protective = NULL;
+  if (updated.position_primary == 1 && gpt_read_mbr(handle, &mbr) &&
+      gpt_mbr_type(&mbr) != GPT_MBR_LEGACY) {
+    gpt_set_protective_mbr(&mbr, &updated, true);
+    protective = &mbr;
+  }
+
+  if ((error = gpt_write_header_with_mbr(handle, &updated,
+                                          protective)) != GPT_SUCCESS ||
+      (error = gpt_sync(handle)) != GPT_SUCCESS) {
+    return error;
+  }
+  uint64_t stale = header->position_secondary;
+  memcpy(header, &updated, sizeof(struct GPT_Header));
+
+  /* invalidate stale secondary header */
+  if (stale != updated.position_secondary && stale < lba_count) {
+    if (!gpt_zero_range(handle, stale * handle->lba_size, handle->lba_size)) {
+      return GPT_WRITE_ERROR;
+    }
+    if ((error = gpt_sync(handle)) != GPT_SUCCESS) {
+      return error;
+    }
+  }
+  return GPT_SUCCESS;
+}
+
+bool gpt_entry_is_used(struct GPT_Entry *entry) {
+  static const uint8_t unused[16];
+  return memcmp(entry->type_guid, unused, sizeof(unused)) != 0;
+}
+
+bool gpt_pread_header(int fd, uint64_t offset, struct GPT_Header *header) {
+  struct GPT_Header_Raw data;
+  if (pread(fd, &data, sizeof(struct GPT_Header_Raw), offset) !=
+        sizeof(struct GPT_Header_Raw)) {
+    return false;
+  }
+  gpt_copy_raw_header(header, &data);
+  return true;
+}
+
+struct GPT_Entry *gpt_pread_entries(int fd, uint64_t offset,
+                                      struct GPT_Header *header, bool *valid) {
+  /* entry size has to be 128 * 2^n */
+  if (header->entry_size < sizeof(struct GPT_Entry_Raw) ||
+      header->entry_size > GPT_MAX_ENTRY_SIZE ||
+      (header->entry_size & (header->entry_size - 1)) != 0 ||
+      header->entries == 0 || header->entries > GPT_MAX_ENTRIES) {
+    return NULL;
+  }
+
+  size_t length = (size_t)header->entries * header->entry_size;
+  uint8_t *data = (uint8_t *)malloc(length);
+  struct GPT_Entry *entries = (struct GPT_Entry *)malloc(
+                        sizeof(struct GPT_Entry) * header->entries);
+  if (data == NULL || entries == NULL ||
+      pread(fd, data, length, offset) != (ssize_t)length) {
+    free(data);
+    free(entries);
+    return NULL;
+  }
+
+  /* checksum covers the on-disk layout, which padding is dropped from */
+  uint32_t crc = 0;
+  crc32(data, length, &crc);
+  *valid = crc == header->crc32_entries;
+
+  for (uint32_t x = 0; x < header->entries; x++) {
+    gpt_copy_raw_entry(entries + x,
+                  (struct GPT_Entry_Raw *)(data + x * header->entry_size));
+  }
+  free(data);
+  return entries;
+}
+
+bool gpt_read_mbr(struct GPT_Handle *handle, struct GPT_MBR *mbr) {
+  struct GPT_MBR_Raw data;
+  if (fseek((FILE *)handle->file, 0, SEEK_SET) != 0 ||
+      fread(&data, sizeof(struct GPT_MBR_Raw), 1, (FILE *)handle->file) != 1) {
+    return false;
+  }
+  gpt_copy_raw_mbr(mbr, &data);
+  return true;
+}
+
+static struct GPT_MBR_Partition *gpt_find_protective(struct GPT_MBR *mbr) {
+  for (int x = 0; x < 4; x++) {
+    if (mbr->partitions[x].type == GPT_MBR_TYPE_PROTECTIVE) {
+      return mbr->partitions + x;
+    }
+  }
+  return NULL;
+}
+
+void gpt_set_protective_mbr(struct GPT_MBR *mbr, struct GPT_Header *header,
+                              bool keep_hybrid) {
+  if (mbr->signature != GPT_MBR_SIGNATURE) {
+    memset(mbr, 0, sizeof(struct GPT_MBR));
+    keep_hybrid = false;
+  }
+
+  struct GPT_MBR_Partition *protective = gpt_find_protective(mbr);
+  if (!keep_hybrid || protective == NULL) {
+    /* keep boot code and disk signature, drop all other partitions */
+    memset(mbr->partitions, 0, sizeof(mbr->partitions));
+    protective = mbr->partitions;
+    protective->chs_first[1] = 0x02;
+    protective->type = GPT_MBR_TYPE_PROTECTIVE;
+    memset(protective->chs_last, 0xFF, sizeof(protective->chs_last));
+    protective->first_lba = 1;
+  }
+
+  /* a hybrid 0xEE partition covering only the GPT area in front of the
+   * hybrid partitions keeps its size, only one that reached the old disk
+   * end behind all other partitions follows the disk end */
+  bool resize = true;
+  uint64_t end = (uint64_t)protective->first_lba + protective->sectors;
+  for (int x = 0; x < 4; x++) {
+    struct GPT_MBR_Partition *partition = mbr->partitions + x;
+    if (partition != protective && partition->type != 0 &&
+        (uint64_t)partition->first_lba + partition->sectors > end) {
+      resize = false;
+    }
+  }
+
+  if (resize) {
+    protective->sectors = header->position_secondary > 0xFFFFFFFF ?
+                            0xFFFFFFFF : header->position_secondary;
+  }
+  mbr->signature = GPT_MBR_SIGNATURE;
+}
+
+enum GPT_MBR_Type gpt_mbr_type(struct GPT_MBR *mbr) {
+  if (mbr->signature != GPT_MBR_SIGNATURE) {
+    return GPT_MBR_NONE;
+  }
+
+  bool protective = false, other = false;
+  for (int x = 0; x < 4; x++) {
+    if (mbr->partitions[x].type == GPT_MBR_TYPE_PROTECTIVE) {
+      protective = true;
+    } else if (mbr->partitions[x].type != 0) {
+      other = true;
+    }
+  }
+
+  if (!protective) {
+    return GPT_MBR_LEGACY;
+  }
+  return other ? GPT_MBR_HYBRID : GPT_MBR_PROTECTIVE;
+}
+
+enum GPT_Error gpt_verify_mbr(struct GPT_Handle *handle,
+                                struct GPT_Header *header,
+                                struct GPT_MBR *mbr) {
+  enum GPT_MBR_Type type = gpt_mbr_type(mbr);
+  if (type == GPT_MBR_NONE) {
+    return GPT_MISSING_MBR;
+  }
+  if (type == GPT_MBR_LEGACY) {
+    return GPT_NO_PROTECTIVE_PARTITION;
+  }
+
+  struct GPT_MBR_Partition *protective = gpt_find_protective(mbr);
+  if (protective->first_lba != header->position_primary) {
+    return GPT_BAD_PROTECTIVE_POSITION;
+  }
+
+  /* hybrid 0xEE partitions usually cover only part of the disk */
+  uint64_t sectors = header->position_secondary > 0xFFFFFFFF ?
+                      0xFFFFFFFF : header->position_secondary;
+  if (type == GPT_MBR_PROTECTIVE && protective->sectors != sectors) {
+    return GPT_BAD_PROTECTIVE_SIZE;
+  }
+
+  /* secondary header belongs to the last LBA, else the disk was resized */
+  uint64_t disk_size;
+  if (gpt_get_disk_size(handle, &disk_size) &&
+      disk_size / handle->lba_size != header->position_secondary + 1) {
+    return GPT_BAD_SECONDARY_POSITION;
+  }
+
+  return type == GPT_MBR_HYBRID ? GPT_HYBRID_MBR : GPT_SUCCESS;
+}
@@ -48,6 +48,29 @@ struct GPT_Entry_Raw {
   uint16_t name[36];
 } __attribute__((packed));
 
+struct GPT_MBR_Partition_Raw {
+  uint8_t status;
+  uint8_t chs_first[3];
+  uint8_t type;
+  uint8_t chs_last[3];
+  uint32_t first_lba;
+  uint32_t sectors;
+} __attribute__((packed));
+
+struct GPT_MBR_Raw {
+  uint8_t boot_code[440];
+  uint32_t disk_signature;
+  uint16_t reserved;
+  struct GPT_MBR_Partition_Raw partitions[4];
+  uint16_t signature;
+} __attribute__((packed));
+
+#define GPT_MAX_ENTRIES 65536
+#define GPT_MAX_ENTRY_SIZE 4096
+#define GPT_DETECT_SIZE 8192
+#define GPT_MAX_PREFIX_SIZE 0x100000
+
+
 void gpt_copy_raw_header(struct GPT_Header *dest, struct GPT_Header_Raw *src);
 
 void gpt_copy_header(struct GPT_Header_Raw *dest, struct GPT_Header *src);
@@ -56,7 +79,62 @@ void gpt_copy_raw_entry(struct GPT_Entry *dest, struct GPT_Entry_Raw *src);
 
 void gpt_copy_entry(struct GPT_Entry_Raw *dest, struct GPT_Entry *src);
 
+void gpt_copy_raw_mbr(struct GPT_MBR *dest, struct GPT_MBR_Raw *src);
+
+void gpt_copy_mbr(struct GPT_MBR_Raw *dest, struct GPT_MBR *src);
+
 bool gpt_write_padding(struct GPT_Handle *handle, int padding);
 
 bool gpt_write_pad(struct GPT_Handle *handle, void *pad, int pad_size,
                         int padding);
+
+bool gpt_get_disk_size(struct GPT_Handle *handle, uint64_t *size);
+
+bool gpt_zero_range(struct GPT_Handle *handle, uint64_t offset,
+                        uint64_t length);
+
+enum GPT_Error gpt_sync(struct GPT_Handle *handle);
+
+enum GPT_Error gpt_write_header_at(struct GPT_Handle *handle,
+                                    struct GPT_Header *header, uint64_t lba);
+
+enum GPT_Error gpt_write_entries_at(struct GPT_Handle *handle,
+                                      struct GPT_Header *header,
+                                      struct GPT_Entry *entries, uint64_t lba);
+
+bool gpt_read_mbr(struct GPT_Handle *handle, struct GPT_MBR *mbr);
+
+void gpt_make_secondary_header(struct GPT_Header *dest,
+                                struct GPT_Header *src, uint64_t entries_lba);
+
+bool gpt_entry_is_used(struct GPT_Entry *entry);
+
+bool gpt_verify_crc32(struct GPT_Header *header);
+
+bool gpt_verify_entries_crc32(struct GPT_Header *header,
+                                struct GPT_Entry *entries);
+
+bool gpt_pread_header(int fd, uint64_t offset, struct GPT_Header *header);
+
+struct GPT_Entry *gpt_pread_entries(int fd, uint64_t offset,
+                                      struct GPT_Header *header, bool *valid);
+
+/* on a miss sequence receives the slot version to pass to publish, which
+ * then only fills the slot if nothing was published in between; write
+ * paths publish with NULL */
+bool gpt_cache_get_header(struct GPT_Handle *handle, struct GPT_Header *header,
+                            uint64_t *sequence);
+
+bool gpt_cache_get_entries(struct GPT_Handle *handle, struct GPT_Header *header,
+                            struct GPT_Entry *entries, uint64_t *sequence);
+
+void gpt_cache_publish_header(struct GPT_Handle *handle,
+                                struct GPT_Header *header,
+                                const uint64_t *expected);
+
+void gpt_cache_publish_entries(struct GPT_Handle *handle,
+                                struct GPT_Header *header,
+                                struct GPT_Entry *entries,
+                                const uint64_t *expected);
+
+void gpt_cache_detach(struct GPT_Handle *handle);
@@ -0,0 +1,359 @@
+/**
+ * Copyright (c) 2017 Viktor Schneider <info@vjs.io>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "gpt-manipulator.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+struct GPT_Token_Bucket {
+  uint64_t rate;
+  uint64_t burst;
+  double tokens;
+  uint64_t last;
+};
+
+struct GPT_Scrub_Device {
+  struct GPT_Handle *handle;
+  int priority;
+  uint64_t due;
+  struct GPT_Token_Bucket bucket;
+};
+
+struct GPT_Scrubber {
+  struct GPT_Scrubber_Options options;
+  struct GPT_Token_Bucket bucket;
+  struct GPT_Scrub_Device **devices;
+  size_t device_count;
+  size_t device_size;
+  struct GPT_Handle *active;
+  bool stop;
+  unsigned int seed;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t wakeup;
+  pthread_cond_t idle;
+};
+
+static uint64_t gpt_scrub_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void gpt_scrub_init_bucket(struct GPT_Token_Bucket *bucket,
+                                    uint64_t rate, uint64_t burst) {
+  bucket->rate = rate;
+  bucket->burst = burst == 0 ? rate : burst;
+  bucket->tokens = bucket->burst;
+  bucket->last = gpt_scrub_now();
+}
+
+/**
+ * Refill bucket and return nanoseconds until cost bytes may be read.
+ *      Costs above the burst size are allowed once the bucket is full.
+ */
+static uint64_t gpt_scrub_bucket_wait(struct GPT_Token_Bucket *bucket,
+                                        uint64_t cost, uint64_t now) {
+  if (bucket->rate == 0) {
+    return 0;
+  }
+
+  bucket->tokens += (double)bucket->rate * (now - bucket->last) / 1e9;
+  if (bucket->tokens > bucket->burst) {
+    bucket->tokens = bucket->burst;
+  }
+  bucket->last = now;
+
+  double needed = cost > bucket->burst ? bucket->burst : cost;
+  if (bucket->tokens >= needed) {
+    return 0;
+  }
+  return (uint64_t)((needed - bucket->tokens) * 1e9 / bucket->rate) + 1;
+}
+
+/**
+ * Wait up to ns nanoseconds or until the scrubber is woken up.
+ *      Mutex of scrubber has to be locked.
+ */
+static void gpt_scrub_sleep(struct GPT_Scrubber *scrubber, uint64_t ns) {
+  uint64_t until = gpt_scrub_now() + ns;
+  struct timespec time;
+  time.tv_sec = until / 1000000000;
+  time.tv_nsec = until % 1000000000;
+  pthread_cond_timedwait(&scrubber->wakeup, &scrubber->mutex, &time);
+}
+
+/**
+ * Take cost bytes from device and global bucket, returns false if the
+ *      scrubber was stopped while waiting
+ */
+static bool gpt_scrub_acquire(struct GPT_Scrubber *scrubber,
+                                struct GPT_Scrub_Device *device,
+                                uint64_t cost) {
+  pthread_mutex_lock(&scrubber->mutex);
+  while (!scrubber->stop) {
+    uint64_t now = gpt_scrub_now();
+    uint64_t wait = gpt_scrub_bucket_wait(&device->bucket, cost, now);
+    uint64_t global = gpt_scrub_bucket_wait(&scrubber->bucket, cost, now);
+    if (global > wait) {
+      wait = global;
+    }
+    if (wait == 0) {
+      device->bucket.tokens -= cost;
+      scrubber->bucket.tokens -= cost;
+      break;
+    }
+    gpt_scrub_sleep(scrubber, wait);
+  }
+  bool stopped = scrubber->stop;
+  pthread_mutex_unlock(&scrubber->mutex);
+  return !stopped;
+}
+
+static void gpt_scrub_report(struct GPT_Scrubber *scrubber,
+                              struct GPT_Handle *handle,
+                              enum GPT_Scrub_Check check,
+                              enum GPT_Error error) {
+  if (scrubber->options.callback != NULL) {
+    scrubber->options.callback(handle, check, error, scrubber->options.data);
+  }
+}
+
+static void gpt_scrub_device(struct GPT_Scrubber *scrubber,
+                              struct GPT_Scrub_Device *device) {
+  struct GPT_Handle *handle = device->handle;
+  int fd = fileno((FILE *)handle->file);
+
+  if (!gpt_scrub_acquire(scrubber, device, handle->lba_size)) {
+    return;
+  }
+  struct GPT_Header header;
+  if (!gpt_pread_header(fd, handle->offset, &header)) {
+    gpt_scrub_report(scrubber, handle, GPT_SCRUB_HEADER, GPT_READ_ERROR);
+    return;
+  }
+  enum GPT_Error error = gpt_verify_header(handle, &header);
+  if (error != GPT_SUCCESS) {
+    gpt_scrub_report(scrubber, handle, GPT_SCRUB_HEADER, error);
+    return;
+  }
+
+  /* entries and secondary header are only meaningful with a valid header */
+  uint64_t entries_size = (uint64_t)header.entries * header.entry_size;
+  if (!gpt_scrub_acquire(scrubber, device, entries_size)) {
+    return;
+  }
+  bool valid;
+  struct GPT_Entry *entries = gpt_pread_entries(fd,
+                  header.position_entries * handle->lba_size, &header, &valid);
+  if (entries == NULL) {
+    gpt_scrub_report(scrubber, handle, GPT_SCRUB_ENTRIES, GPT_READ_ERROR);
+  } else {
+    error = valid ? gpt_verify_entries(handle, &header, entries) :
+                    GPT_CRC32_MISMATCH;
+    free(entries);
+    if (error != GPT_SUCCESS) {
+      gpt_scrub_report(scrubber, handle, GPT_SCRUB_ENTRIES, error);
+    }
+  }
+
+  if (!gpt_scrub_acquire(scrubber, device, handle->lba_size + entries_size)) {
+    return;
+  }
+  error = gpt_verify_scondary_header(handle, &header);
+  if (error != GPT_SUCCESS) {
+    gpt_scrub_report(scrubber, handle, GPT_SCRUB_SECONDARY, error);
+  }
+}
+
+static uint64_t gpt_scrub_delay(struct GPT_Scrubber *scrubber,
+                                  unsigned int interval) {
+  uint64_t delay = interval;
+  if (scrubber->options.jitter != 0) {
+    delay += rand_r(&scrubber->seed) % (scrubber->options.jitter + 1);
+  }
+  return delay * 1000000;
+}
+
+static void *gpt_scrub_thread(void *data) {
+  struct GPT_Scrubber *scrubber = (struct GPT_Scrubber *)data;
+
+  pthread_mutex_lock(&scrubber->mutex);
+  while (!scrubber->stop) {
+    /* due device with highest priority, earliest due time first */
+    uint64_t now = gpt_scrub_now();
+    uint64_t next = UINT64_MAX;
+    struct GPT_Scrub_Device *device = NULL;
+    for (size_t x = 0; x < scrubber->device_count; x++) {
+      struct GPT_Scrub_Device *candidate = scrubber->devices[x];
+      if (candidate->due > now) {
+        if (candidate->due < next) {
+          next = candidate->due;
+        }
+        continue;
+      }
+      if (device == NULL || candidate->priority > device->priority ||
+          (candidate->priority == device->priority &&
+           candidate->due < device->due)) {
+        device = candidate;
+      }
+    }
+
+    if (device == NULL) {
+      if (next == UINT64_MAX) {
+        pthread_cond_wait(&scrubber->wakeup, &scrubber->mutex);
+      } else {
+        gpt_scrub_sleep(scrubber, next - now);
+      }
+      continue;
+    }
+
+    scrubber->active = device->handle;
+    pthread_mutex_unlock(&scrubber->mutex);
+
+    gpt_scrub_device(scrubber, device);
+
+    pthread_mutex_lock(&scrubber->mutex);
+    device->due = gpt_scrub_now() +
+                    gpt_scrub_delay(scrubber, scrubber->options.interval);
+    scrubber->active = NULL;
+    pthread_cond_broadcast(&scrubber->idle);
+  }
+  pthread_mutex_unlock(&scrubber->mutex);
+
+  return NULL;
+}
+
+struct GPT_Scrubber *gpt_scrubber_create(
+                                  const struct GPT_Scrubber_Options *options) {
+  struct GPT_Scrubber *scrubber = (struct GPT_Scrubber *)calloc(1,
+                                          sizeof(struct GPT_Scrubber));
+  if (scrubber == NULL) {
+    return NULL;
+  }
+
+  /* options stay zeroed without limits, callback and interval */
+  if (options != NULL) {
+    memcpy(&scrubber->options, options, sizeof(struct GPT_Scrubber_Options));
+  }
+  if (scrubber->options.interval == 0) {
+    scrubber->options.interval = GPT_DEFAULT_SCRUB_INTERVAL;
+  }
+  gpt_scrub_init_bucket(&scrubber->bucket, scrubber->options.global_rate,
+                          scrubber->options.global_burst);
+  scrubber->seed = (unsigned int)gpt_scrub_now();
+
+  pthread_condattr_t attributes;
+  pthread_condattr_init(&attributes);
+  pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+  pthread_mutex_init(&scrubber->mutex, NULL);
+  pthread_cond_init(&scrubber->wakeup, &attributes);
+  pthread_cond_init(&scrubber->idle, NULL);
+  pthread_condattr_destroy(&attributes);
+
+  if (pthread_create(&scrubber->thread, NULL, gpt_scrub_thread,
+                      scrubber) != 0) {
+    pthread_cond_destroy(&scrubber->idle);
+    pthread_cond_destroy(&scrubber->wakeup);
+    pthread_mutex_destroy(&scrubber->mutex);
+    free(scrubber);
+    return NULL;
+  }
+
+  return scrubber;
+}
+
+bool gpt_scrubber_add(struct GPT_Scrubber *scrubber, struct GPT_Handle *handle,
+                        int priority) {
+  struct GPT_Scrub_Device *device = (struct GPT_Scrub_Device *)malloc(
+                                          sizeof(struct GPT_Scrub_Device));
+  if (device == NULL) {
+    return false;
+  }
+  device->handle = handle;
+  device->priority = priority;
+  gpt_scrub_init_bucket(&device->bucket, scrubber->options.device_rate,
+                          scrubber->options.device_burst);
+
+  pthread_mutex_lock(&scrubber->mutex);
+  if (scrubber->device_count == scrubber->device_size) {
+    size_t size = scrubber->device_size == 0 ? 16 : scrubber->device_size * 2;
+    struct GPT_Scrub_Device **devices = (struct GPT_Scrub_Device **)realloc(
+                  scrubber->devices, sizeof(struct GPT_Scrub_Device *) * size);
+    if (devices == NULL) {
+      pthread_mutex_unlock(&scrubber->mutex);
+      free(device);
+      return false;
+    }
+    scrubber->devices = devices;
+    scrubber->device_size = size;
+  }
+
+  /* first pass is spread by jitter only */
+  device->due = gpt_scrub_now() + gpt_scrub_delay(scrubber, 0);
+  scrubber->devices[scrubber->device_count++] = device;
+  pthread_cond_signal(&scrubber->wakeup);
+  pthread_mutex_unlock(&scrubber->mutex);
+
+  return true;
+}
+
+bool gpt_scrubber_remove(struct GPT_Scrubber *scrubber,
+                          struct GPT_Handle *handle) {
+  pthread_mutex_lock(&scrubber->mutex);
+  while (scrubber->active == handle) {
+    pthread_cond_wait(&scrubber->idle, &scrubber->mutex);
+  }
+
+  bool found = false;
+  for (size_t x = 0; x < scrubber->device_count; x++) {
+    if (scrubber->devices[x]->handle == handle) {
+      free(scrubber->devices[x]);
+      scrubber->devices[x] = scrubber->devices[--scrubber->device_count];
+      found = true;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&scrubber->mutex);
+
+  return found;
+}
+
+void gpt_free_scrubber(struct GPT_Scrubber *scrubber) {
+  pthread_mutex_lock(&scrubber->mutex);
+  scrubber->stop = true;
+  pthread_cond_broadcast(&scrubber->wakeup);
+  pthread_mutex_unlock(&scrubber->mutex);
+  pthread_join(scrubber->thread, NULL);
+
+  for (size_t x = 0; x < scrubber->device_count; x++) {
+    free(scrubber->devices[x]);
+  }
+  free(scrubber->devices);
+  pthread_cond_destroy(&scrubber->idle);
+  pthread_cond_destroy(&scrubber->wakeup);
+  pthread_mutex_destroy(&scrubber->mutex);
+  free(scrubber);
+}
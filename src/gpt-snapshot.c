@@ -0,0 +1,547 @@
+/**
+ * Copyright (c) 2017 Viktor Schneider <info@vjs.io>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "gpt-manipulator.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Snapshot layout, all values little endian:
+ *   file header | table records ... | type GUIDs | table index
+ * A table record is a length prefixed GPT_Snapshot_Table followed by its
+ * used entries, the index holds the file offset of every record.
+ */
+
+#define GPT_SNAPSHOT_MAGIC "GPTSNAP"
+#define GPT_SNAPSHOT_VERSION 1
+
+struct GPT_Snapshot_File {
+  uint8_t magic[8];
+  uint32_t version;
+  uint32_t tables;
+  uint32_t types;
+  uint32_t reserved;
+  uint64_t types_offset;
+  uint64_t index_offset;
+};
+
+struct GPT_Snapshot_Table {
+  uint32_t length;
+  uint32_t entries;
+  struct GPT_Header_Raw header;
+  uint32_t reserved;
+};
+
+struct GPT_Snapshot_Writer {
+  FILE *file;
+  uint64_t position;
+  uint64_t *index;
+  uint32_t tables;
+  uint32_t index_size;
+  uint8_t (*types)[16];
+  uint32_t type_count;
+  uint32_t *type_slots;
+  uint32_t type_slot_count;
+  enum GPT_Error error;
+};
+
+struct GPT_Snapshot {
+  const uint8_t *map;
+  size_t size;
+  const struct GPT_Snapshot_File *file;
+  const uint8_t (*types)[16];
+  const uint64_t *index;
+};
+
+static uint32_t gpt_snapshot_hash(const uint8_t *guid) {
+  uint64_t a, b;
+  memcpy(&a, guid, sizeof(a));
+  memcpy(&b, guid + 8, sizeof(b));
+  a ^= b * 0x9E3779B97F4A7C15ULL;
+  return (uint32_t)((a * 0xBF58476D1CE4E5B9ULL) >> 32);
+}
+
+static bool gpt_snapshot_grow_types(struct GPT_Snapshot_Writer *writer) {
+  uint32_t count = writer->type_slot_count * 2;
+  uint32_t *slots = (uint32_t *)malloc(sizeof(uint32_t) * count);
+  uint8_t (*types)[16] = realloc(writer->types, 16 * (size_t)count / 2);
+  if (slots == NULL || types == NULL) {
+    free(slots);
+    if (types != NULL) {
+      writer->types = types;
+    }
+    return false;
+  }
+  writer->types = types;
+
+  /* slots hold type index + 1, 0 marks a free slot */
+  memset(slots, 0, sizeof(uint32_t) * count);
+  for (uint32_t x = 0; x < writer->type_count; x++) {
+    uint32_t slot = gpt_snapshot_hash(types[x]) & (count - 1);
+    while (slots[slot] != 0) {
+      slot = (slot + 1) & (count - 1);
+    }
+    slots[slot] = x + 1;
+  }
+  free(writer->type_slots);
+  writer->type_slots = slots;
+  writer->type_slot_count = count;
+  return true;
+}
+
+static bool gpt_snapshot_type_index(struct GPT_Snapshot_Writer *writer,
+                                      const uint8_t *guid, uint32_t *index) {
+  uint32_t mask = writer->type_slot_count - 1;
+  uint32_t slot = gpt_snapshot_hash(guid) & mask;
+  for (; writer->type_slots[slot] != 0; slot = (slot + 1) & mask) {
+    uint32_t x = writer->type_slots[slot] - 1;
+    if (memcmp(writer->types[x], guid, 16) == 0) {
+      *index = x;
+      return true;
+    }
+  }
+
+  /* keep load factor at most 1/2 */
+  if ((writer->type_count + 1) * 2 > writer->type_slot_count) {
+    if (!gpt_snapshot_grow_types(writer)) {
+      return false;
+    }
+    return gpt_snapshot_type_index(writer, guid, index);
+  }
+
+  memcpy(writer->types[writer->type_count], guid, 16);
+  writer->type_slots[slot] = ++writer->type_count;
+  *index = writer->type_count - 1;
+  return true;
+}
+
+struct GPT_Snapshot_Writer *gpt_snapshot_create(const char *path) {
+  struct GPT_Snapshot_Writer *writer = (struct GPT_Snapshot_Writer *)calloc(
+                                    1, sizeof(struct GPT_Snapshot_Writer));
+  if (writer == NULL) {
+    return NULL;
+  }
+
+  writer->index_size = 1024;
+  writer->index = (uint64_t *)malloc(sizeof(uint64_t) * writer->index_size);
+  writer->type_slot_count = 64;
+  writer->type_slots = (uint32_t *)calloc(writer->type_slot_count,
+                                            sizeof(uint32_t));
+  writer->types = malloc(16 * writer->type_slot_count / 2);
+  writer->file = fopen(path, "w");
+  if (writer->index == NULL || writer->type_slots == NULL ||
+      writer->types == NULL || writer->file == NULL) {
+    if (writer->file != NULL) {
+      fclose(writer->file);
+    }
+    free(writer->index);
+    free(writer->type_slots);
+    free(writer->types);
+    free(writer);
+    return NULL;
+  }
+  setvbuf(writer->file, NULL, _IOFBF, 1 << 20);
+
+  /* file header is written on close, once all offsets are known */
+  struct GPT_Snapshot_File file;
+  memset(&file, 0, sizeof(struct GPT_Snapshot_File));
+  if (fwrite(&file, sizeof(struct GPT_Snapshot_File), 1, writer->file) != 1) {
+    fclose(writer->file);
+    writer->file = NULL;
+    gpt_snapshot_close(writer);
+    return NULL;
+  }
+  writer->position = sizeof(struct GPT_Snapshot_File);
+
+  return writer;
+}
+
+enum GPT_Error gpt_snapshot_add(struct GPT_Snapshot_Writer *writer,
+                                  struct GPT_Header *header,
+                                  struct GPT_Entry *entries) {
+  if (writer->error != GPT_SUCCESS) {
+    return writer->error;
+  }
+  if (writer->tables == writer->index_size) {
+    uint64_t *index = (uint64_t *)realloc(writer->index,
+                              sizeof(uint64_t) * writer->index_size * 2);
+    if (index == NULL) {
+      return GPT_ALLOCATION_ERROR;
+    }
+    writer->index = index;
+    writer->index_size *= 2;
+  }
+
+  /* types are registered up front, so a record is never left half
+   * written because of an allocation failure */
+  struct GPT_Snapshot_Table table;
+  memset(&table, 0, sizeof(struct GPT_Snapshot_Table));
+  uint32_t type_index;
+  for (uint32_t x = 0; x < header->entries; x++) {
+    if (!gpt_entry_is_used(entries + x)) {
+      continue;
+    }
+    if (!gpt_snapshot_type_index(writer, entries[x].type_guid, &type_index)) {
+      return GPT_ALLOCATION_ERROR;
+    }
+    table.entries++;
+  }
+  table.length = sizeof(struct GPT_Snapshot_Table) +
+                  table.entries * sizeof(struct GPT_Snapshot_Entry);
+  gpt_copy_header(&table.header, header);
+
+  /* a failed write leaves a partial record, later offsets would be wrong */
+  if (fwrite(&table, sizeof(struct GPT_Snapshot_Table), 1, writer->file) != 1) {
+    writer->error = GPT_WRITE_ERROR;
+    return writer->error;
+  }
+
+  struct GPT_Snapshot_Entry entry;
+  memset(&entry, 0, sizeof(struct GPT_Snapshot_Entry));
+  for (uint32_t x = 0; x < header->entries; x++) {
+    if (!gpt_entry_is_used(entries + x)) {
+      continue;
+    }
+    gpt_snapshot_type_index(writer, entries[x].type_guid, &entry.type_index);
+    entry.first_lba = entries[x].first_lba;
+    entry.last_lba = entries[x].last_lba;
+    entry.attributes = entries[x].attributes;
+    entry.slot = x;
+    memcpy(entry.guid, entries[x].guid, sizeof(entry.guid));
+    memcpy(entry.name, entries[x].name, sizeof(entry.name));
+    if (fwrite(&entry, sizeof(struct GPT_Snapshot_Entry), 1,
+                writer->file) != 1) {
+      writer->error = GPT_WRITE_ERROR;
+      return writer->error;
+    }
+  }
+
+  writer->index[writer->tables++] = writer->position;
+  writer->position += table.length;
+  return GPT_SUCCESS;
+}
+
+enum GPT_Error gpt_snapshot_close(struct GPT_Snapshot_Writer *writer) {
+  enum GPT_Error error = writer->error;
+  if (writer->file != NULL && error != GPT_SUCCESS) {
+    /* file header stays zeroed, gpt_snapshot_open rejects the file */
+    fclose(writer->file);
+  } else if (writer->file != NULL) {
+    struct GPT_Snapshot_File file;
+    memset(&file, 0, sizeof(struct GPT_Snapshot_File));
+    memcpy(file.magic, GPT_SNAPSHOT_MAGIC, sizeof(GPT_SNAPSHOT_MAGIC));
+    file.version = GPT_SNAPSHOT_VERSION;
+    file.tables = writer->tables;
+    file.types = writer->type_count;
+    file.types_offset = writer->position;
+    file.index_offset = file.types_offset + 16 * (uint64_t)file.types;
+    /* keep index 8 byte aligned for in place access */
+    uint64_t align = (8 - file.index_offset % 8) % 8;
+    file.index_offset += align;
+
+    uint64_t zero = 0;
+    if ((file.types != 0 &&
+         fwrite(writer->types, 16, file.types, writer->file) != file.types) ||
+        (align != 0 && fwrite(&zero, align, 1, writer->file) != 1) ||
+        (file.tables != 0 &&
+         fwrite(writer->index, sizeof(uint64_t), file.tables,
+                writer->file) != file.tables)) {
+      error = GPT_WRITE_ERROR;
+    } else if (fseek(writer->file, 0, SEEK_SET) != 0) {
+      error = GPT_SEEK_ERROR;
+    } else if (fwrite(&file, sizeof(struct GPT_Snapshot_File), 1,
+                      writer->file) != 1) {
+      error = GPT_WRITE_ERROR;
+    }
+
+    if (fclose(writer->file) != 0 && error == GPT_SUCCESS) {
+      error = GPT_WRITE_ERROR;
+    }
+  }
+
+  free(writer->index);
+  free(writer->type_slots);
+  free(writer->types);
+  free(writer);
+  return error;
+}
+
+struct GPT_Snapshot *gpt_snapshot_open(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      (uint64_t)st.st_size < sizeof(struct GPT_Snapshot_File)) {
+    close(fd);
+    return NULL;
+  }
+
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
+
+  /* compare against remaining space, offsets are untrusted and may overflow */
+  const struct GPT_Snapshot_File *file = (const struct GPT_Snapshot_File *)map;
+  uint64_t size = st.st_size;
+  if (memcmp(file->magic, GPT_SNAPSHOT_MAGIC, sizeof(GPT_SNAPSHOT_MAGIC)) != 0 ||
+      file->version != GPT_SNAPSHOT_VERSION ||
+      file->types_offset < sizeof(struct GPT_Snapshot_File) ||
+      file->index_offset < file->types_offset ||
+      file->index_offset > size ||
+      file->index_offset % 8 != 0 ||
+      file->types > (file->index_offset - file->types_offset) / 16 ||
+      file->tables > (size - file->index_offset) / sizeof(uint64_t)) {
+    munmap(map, st.st_size);
+    return NULL;
+  }
+
+  struct GPT_Snapshot *snapshot = (struct GPT_Snapshot *)malloc(
+                                          sizeof(struct GPT_Snapshot));
+  if (snapshot == NULL) {
+    munmap(map, st.st_size);
+    return NULL;
+  }
+  snapshot->map = (const uint8_t *)map;
+  snapshot->size = st.st_size;
+  snapshot->file = file;
+  snapshot->types = (const uint8_t (*)[16])(snapshot->map + file->types_offset);
+  snapshot->index = (const uint64_t *)(snapshot->map + file->index_offset);
+
+  return snapshot;
+}
+
+void gpt_snapshot_free(struct GPT_Snapshot *snapshot) {
+  munmap((void *)snapshot->map, snapshot->size);
+  free(snapshot);
+}
+
+uint32_t gpt_snapshot_tables(struct GPT_Snapshot *snapshot) {
+  return snapshot->file->tables;
+}
+
+static const struct GPT_Snapshot_Table *gpt_snapshot_table(
+                      struct GPT_Snapshot *snapshot, uint32_t table) {
+  if (table >= snapshot->file->tables) {
+    return NULL;
+  }
+
+  uint64_t offset = snapshot->index[table];
+  uint64_t end = snapshot->file->types_offset;
+  if (offset % 8 != 0 || offset < sizeof(struct GPT_Snapshot_File) ||
+      offset > end || end - offset < sizeof(struct GPT_Snapshot_Table)) {
+    return NULL;
+  }
+
+  const struct GPT_Snapshot_Table *data =
+              (const struct GPT_Snapshot_Table *)(snapshot->map + offset);
+  if (data->length != sizeof(struct GPT_Snapshot_Table) +
+                        data->entries * (uint64_t)sizeof(struct GPT_Snapshot_Entry) ||
+      data->length > end - offset) {
+    return NULL;
+  }
+  return data;
+}
+
+bool gpt_snapshot_get_header(struct GPT_Snapshot *snapshot, uint32_t table,
+                              struct GPT_Header *header) {
+  const struct GPT_Snapshot_Table *data = gpt_snapshot_table(snapshot, table);
+  if (data == NULL) {
+    return false;
+  }
+
+  struct GPT_Header_Raw raw;
+  memcpy(&raw, &data->header, sizeof(struct GPT_Header_Raw));
+  gpt_copy_raw_header(header, &raw);
+  return true;
+}
+
+const struct GPT_Snapshot_Entry *gpt_snapshot_get_entries(
+                                            struct GPT_Snapshot *snapshot,
+                                            uint32_t table, uint32_t *count) {
+  const struct GPT_Snapshot_Table *data = gpt_snapshot_table(snapshot, table);
+  if (data == NULL) {
+    return NULL;
+  }
+
+  *count = data->entries;
+  return (const struct GPT_Snapshot_Entry *)(data + 1);
+}
+
+const uint8_t *gpt_snapshot_type_guid(struct GPT_Snapshot *snapshot,
+                                        uint32_t type_index) {
+  if (type_index >= snapshot->file->types) {
+    return NULL;
+  }
+  return snapshot->types[type_index];
+}
+
+struct GPT_Json_Buffer {
+  char *data;
+  size_t size;
+  size_t length;
+};
+
+static void gpt_json_put(struct GPT_Json_Buffer *buffer, const char *data,
+                          size_t length) {
+  if (buffer->length < buffer->size) {
+    size_t space = buffer->size - buffer->length;
+    memcpy(buffer->data + buffer->length, data, length < space ? length : space);
+  }
+  buffer->length += length;
+}
+
+static void gpt_json_string(struct GPT_Json_Buffer *buffer, const char *data) {
+  gpt_json_put(buffer, data, strlen(data));
+}
+
+static void gpt_json_uint(struct GPT_Json_Buffer *buffer, uint64_t value) {
+  char digits[20];
+  int x = sizeof(digits);
+  do {
+    digits[--x] = '0' + value % 10;
+    value /= 10;
+  } while (value != 0);
+  gpt_json_put(buffer, digits + x, sizeof(digits) - x);
+}
+
+static void gpt_json_guid(struct GPT_Json_Buffer *buffer, const uint8_t *guid) {
+  /* first three GUID fields are stored little endian */
+  static const int order[16] = {3, 2, 1, 0, 5, 4, 7, 6,
+                                8, 9, 10, 11, 12, 13, 14, 15};
+  static const char hex[] = "0123456789ABCDEF";
+  char text[38];
+  int length = 0;
+  text[length++] = '"';
+  for (int x = 0; x < 16; x++) {
+    if (x == 4 || x == 6 || x == 8 || x == 10) {
+      text[length++] = '-';
+    }
+    text[length++] = hex[guid[order[x]] >> 4];
+    text[length++] = hex[guid[order[x]] & 0xF];
+  }
+  text[length++] = '"';
+  gpt_json_put(buffer, text, length);
+}
+
+static void gpt_json_name(struct GPT_Json_Buffer *buffer, const uint16_t *name) {
+  static const char hex[] = "0123456789abcdef";
+  char text[36 * 6 + 2];
+  int length = 0;
+  text[length++] = '"';
+  for (int x = 0; x < 36 && name[x] != 0; x++) {
+    uint32_t c = name[x];
+    if (c >= 0xD800 && c < 0xDC00 && x + 1 < 36 &&
+        name[x + 1] >= 0xDC00 && name[x + 1] < 0xE000) {
+      c = 0x10000 + ((c - 0xD800) << 10) + (name[++x] - 0xDC00);
+    }
+
+    if (c == '"' || c == '\\') {
+      text[length++] = '\\';
+      text[length++] = c;
+    } else if (c < 0x20) {
+      memcpy(text + length, "\\u00", 4);
+      text[length + 4] = hex[c >> 4];
+      text[length + 5] = hex[c & 0xF];
+      length += 6;
+    } else if (c < 0x80) {
+      text[length++] = c;
+    } else if (c < 0x800) {
+      text[length++] = 0xC0 | (c >> 6);
+      text[length++] = 0x80 | (c & 0x3F);
+    } else if (c < 0x10000) {
+      text[length++] = 0xE0 | (c >> 12);
+      text[length++] = 0x80 | ((c >> 6) & 0x3F);
+      text[length++] = 0x80 | (c & 0x3F);
+    } else {
+      text[length++] = 0xF0 | (c >> 18);
+      text[length++] = 0x80 | ((c >> 12) & 0x3F);
+      text[length++] = 0x80 | ((c >> 6) & 0x3F);
+      text[length++] = 0x80 | (c & 0x3F);
+    }
+  }
+  text[length++] = '"';
+  gpt_json_put(buffer, text, length);
+}
+
+size_t gpt_json_table(char *buffer, size_t size, struct GPT_Header *header,
+                        struct GPT_Entry *entries) {
+  struct GPT_Json_Buffer json = {buffer, size == 0 ? 0 : size - 1, 0};
+
+  gpt_json_string(&json, "{\"guid\":");
+  gpt_json_guid(&json, header->guid);
+  gpt_json_string(&json, ",\"revision\":");
+  gpt_json_uint(&json, header->revision);
+  gpt_json_string(&json, ",\"position_primary\":");
+  gpt_json_uint(&json, header->position_primary);
+  gpt_json_string(&json, ",\"position_secondary\":");
+  gpt_json_uint(&json, header->position_secondary);
+  gpt_json_string(&json, ",\"first_partition_lba\":");
+  gpt_json_uint(&json, header->first_partition_lba);
+  gpt_json_string(&json, ",\"last_partition_lba\":");
+  gpt_json_uint(&json, header->last_partition_lba);
+  gpt_json_string(&json, ",\"position_entries\":");
+  gpt_json_uint(&json, header->position_entries);
+  gpt_json_string(&json, ",\"entry_count\":");
+  gpt_json_uint(&json, header->entries);
+  gpt_json_string(&json, ",\"entry_size\":");
+  gpt_json_uint(&json, header->entry_size);
+  gpt_json_string(&json, ",\"entries\":[");
+
+  bool first = true;
+  for (uint32_t x = 0; x < header->entries; x++) {
+    if (!gpt_entry_is_used(entries + x)) {
+      continue;
+    }
+    gpt_json_string(&json, first ? "{\"index\":" : ",{\"index\":");
+    first = false;
+    gpt_json_uint(&json, x);
+    gpt_json_string(&json, ",\"type_guid\":");
+    gpt_json_guid(&json, entries[x].type_guid);
+    gpt_json_string(&json, ",\"guid\":");
+    gpt_json_guid(&json, entries[x].guid);
+    gpt_json_string(&json, ",\"first_lba\":");
+    gpt_json_uint(&json, entries[x].first_lba);
+    gpt_json_string(&json, ",\"last_lba\":");
+    gpt_json_uint(&json, entries[x].last_lba);
+    gpt_json_string(&json, ",\"attributes\":");
+    gpt_json_uint(&json, entries[x].attributes);
+    gpt_json_string(&json, ",\"name\":");
+    gpt_json_name(&json, entries[x].name);
+    gpt_json_put(&json, "}", 1);
+  }
+  gpt_json_put(&json, "]}", 2);
+
+  if (size != 0) {
+    buffer[json.length < json.size ? json.length : json.size] = '\0';
+  }
+  return json.length;
+}
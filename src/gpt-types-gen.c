@@ -0,0 +1,166 @@
+/**
+ * Copyright (c) 2017 Viktor Schneider <info@vjs.io>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Build time generator for the minimal perfect hash table of gpt-types.def.
+ * Keys are hashed into buckets, the buckets are placed largest first by
+ * searching a displacement (hash seed) which moves all keys of a bucket to
+ * free slots. Lookup needs two hashes and one GUID comparison.
+ */
+
+#include "gpt-types.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+struct GPT_Type_Key {
+  const char *id;
+  const char *guid_text;
+  uint8_t guid[16];
+  uint32_t bucket;
+};
+
+static struct GPT_Type_Key keys[] = {
+#define GPT_TYPE(type, guid, name) {#type, guid, {0}, 0},
+#include "gpt-types.def"
+#undef GPT_TYPE
+};
+
+#define KEY_COUNT (sizeof(keys) / sizeof(keys[0]))
+#define BUCKET_COUNT ((KEY_COUNT + 1) / 2)
+#define MAX_DISPLACEMENT (1 << 24)
+
+static uint32_t bucket_sizes[BUCKET_COUNT];
+
+static int compare_buckets(const void *a, const void *b) {
+  uint32_t first = *(const uint32_t *)a, second = *(const uint32_t *)b;
+  if (bucket_sizes[first] != bucket_sizes[second]) {
+    return bucket_sizes[first] < bucket_sizes[second] ? 1 : -1;
+  }
+  return first < second ? -1 : first > second;
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s output\n", argv[0]);
+    return 1;
+  }
+
+  for (size_t x = 0; x < KEY_COUNT; x++) {
+    if (!gpt_type_parse_guid(keys[x].guid_text, keys[x].guid)) {
+      fprintf(stderr, "%s: invalid GUID %s\n", keys[x].id, keys[x].guid_text);
+      return 1;
+    }
+    for (size_t y = 0; y < x; y++) {
+      if (memcmp(keys[x].guid, keys[y].guid, 16) == 0) {
+        fprintf(stderr, "%s: duplicate GUID of %s\n", keys[x].id, keys[y].id);
+        return 1;
+      }
+    }
+    keys[x].bucket = gpt_type_reduce(gpt_type_hash(keys[x].guid, 0),
+                                      BUCKET_COUNT);
+    bucket_sizes[keys[x].bucket]++;
+  }
+
+  uint32_t order[BUCKET_COUNT];
+  for (uint32_t x = 0; x < BUCKET_COUNT; x++) {
+    order[x] = x;
+  }
+  qsort(order, BUCKET_COUNT, sizeof(uint32_t), compare_buckets);
+
+  int slots[KEY_COUNT];
+  uint32_t displacement[BUCKET_COUNT] = {0};
+  for (size_t x = 0; x < KEY_COUNT; x++) {
+    slots[x] = -1;
+  }
+
+  for (uint32_t x = 0; x < BUCKET_COUNT && bucket_sizes[order[x]] != 0; x++) {
+    uint32_t bucket = order[x];
+    uint32_t seed = 1;
+    for (; seed < MAX_DISPLACEMENT; seed++) {
+      uint32_t taken[KEY_COUNT];
+      uint32_t count = 0;
+      for (size_t y = 0; y < KEY_COUNT; y++) {
+        if (keys[y].bucket != bucket) {
+          continue;
+        }
+        uint32_t slot = gpt_type_reduce(gpt_type_hash(keys[y].guid, seed),
+                                          KEY_COUNT);
+        int free = slots[slot] < 0;
+        for (uint32_t z = 0; z < count; z++) {
+          free &= taken[z] != slot;
+        }
+        if (!free) {
+          break;
+        }
+        taken[count++] = slot;
+      }
+      if (count != bucket_sizes[bucket]) {
+        continue;
+      }
+
+      count = 0;
+      for (size_t y = 0; y < KEY_COUNT; y++) {
+        if (keys[y].bucket == bucket) {
+          slots[taken[count++]] = y;
+        }
+      }
+      displacement[bucket] = seed;
+      break;
+    }
+    if (seed == MAX_DISPLACEMENT) {
+      fprintf(stderr, "no displacement found for bucket %u\n", bucket);
+      return 1;
+    }
+  }
+
+  FILE *output = fopen(argv[1], "w");
+  if (output == NULL) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  fprintf(output, "/* generated by gpt-types-gen from gpt-types.def */\n\n");
+  fprintf(output, "#define GPT_TYPES_BUCKETS %u\n", (unsigned int)BUCKET_COUNT);
+  fprintf(output, "#define GPT_TYPES_SLOTS %u\n\n", (unsigned int)KEY_COUNT);
+  fprintf(output, "static const uint32_t "
+                  "gpt_types_displacement[GPT_TYPES_BUCKETS] = {\n");
+  for (uint32_t x = 0; x < BUCKET_COUNT; x++) {
+    fprintf(output, "  %u,\n", displacement[x]);
+  }
+  fprintf(output, "};\n\n");
+  fprintf(output, "static const struct GPT_Type_Slot "
+                  "gpt_types_slots[GPT_TYPES_SLOTS] = {\n");
+  for (size_t x = 0; x < KEY_COUNT; x++) {
+    fprintf(output, "  {{");
+    for (int y = 0; y < 16; y++) {
+      fprintf(output, y == 0 ? "0x%02X" : ", 0x%02X", keys[slots[x]].guid[y]);
+    }
+    fprintf(output, "}, %s},\n", keys[slots[x]].id);
+  }
+  fprintf(output, "};\n");
+
+  if (fclose(output) != 0) {
+    perror(argv[1]);
+    return 1;
+  }
+  return 0;
+}
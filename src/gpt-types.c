@@ -0,0 +1,149 @@
+/**
+ * Copyright (c) 2017 Viktor Schneider <info@vjs.io>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "gpt-manipulator.h"
+#include "gpt-types.h"
+#include "gpt-types-table.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define GPT_CUSTOM_SLOTS (2 * GPT_MAX_CUSTOM_TYPES)
+
+struct GPT_Custom_Type {
+  uint8_t guid[16];
+  char *name;
+};
+
+static const char *const gpt_type_names[GPT_TYPE_COUNT] = {
+  [GPT_TYPE_UNKNOWN] = "Unknown",
+  [GPT_TYPE_UNUSED] = "Unused",
+#define GPT_TYPE(type, guid, name) [type] = name,
+#include "gpt-types.def"
+#undef GPT_TYPE
+};
+
+/* custom types are published with release stores, lookups need no lock */
+static struct GPT_Custom_Type gpt_custom_types[GPT_MAX_CUSTOM_TYPES];
+static uint32_t gpt_custom_slots[GPT_CUSTOM_SLOTS];
+static uint32_t gpt_custom_count;
+static pthread_mutex_t gpt_custom_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static enum GPT_Type gpt_lookup_builtin_type(const uint8_t *guid) {
+  uint32_t bucket = gpt_type_reduce(gpt_type_hash(guid, 0), GPT_TYPES_BUCKETS);
+  const struct GPT_Type_Slot *slot = gpt_types_slots + gpt_type_reduce(
+          gpt_type_hash(guid, gpt_types_displacement[bucket]), GPT_TYPES_SLOTS);
+  if (memcmp(slot->guid, guid, 16) != 0) {
+    return GPT_TYPE_UNKNOWN;
+  }
+  return slot->type;
+}
+
+static enum GPT_Type gpt_lookup_custom_type(const uint8_t *guid) {
+  uint32_t slot = gpt_type_hash(guid, 0) & (GPT_CUSTOM_SLOTS - 1);
+  uint32_t index;
+  while ((index = __atomic_load_n(gpt_custom_slots + slot,
+                                  __ATOMIC_ACQUIRE)) != 0) {
+    if (memcmp(gpt_custom_types[index - 1].guid, guid, 16) == 0) {
+      return GPT_TYPE_CUSTOM + index - 1;
+    }
+    slot = (slot + 1) & (GPT_CUSTOM_SLOTS - 1);
+  }
+  return GPT_TYPE_UNKNOWN;
+}
+
+static enum GPT_Type gpt_lookup_type(const uint8_t *guid) {
+  enum GPT_Type type = gpt_lookup_builtin_type(guid);
+  if (type != GPT_TYPE_UNKNOWN) {
+    return type;
+  }
+
+  /* skip probing while no custom type is registered */
+  if (__atomic_load_n(&gpt_custom_count, __ATOMIC_RELAXED) == 0) {
+    return GPT_TYPE_UNKNOWN;
+  }
+  return gpt_lookup_custom_type(guid);
+}
+
+enum GPT_Type gpt_classify_entry(struct GPT_Entry *entry, const char **name) {
+  enum GPT_Type type = gpt_entry_is_used(entry) ?
+                        gpt_lookup_type(entry->type_guid) : GPT_TYPE_UNUSED;
+  if (name != NULL) {
+    *name = gpt_type_name(type);
+  }
+  return type;
+}
+
+void gpt_classify_entries(struct GPT_Header *header, struct GPT_Entry *entries,
+                            enum GPT_Type *types) {
+  for (uint32_t x = 0; x < header->entries; x++) {
+    types[x] = gpt_classify_entry(entries + x, NULL);
+  }
+}
+
+const char *gpt_type_name(enum GPT_Type type) {
+  if (type >= 0 && type < GPT_TYPE_COUNT) {
+    return gpt_type_names[type];
+  }
+  if (type >= GPT_TYPE_CUSTOM && type - GPT_TYPE_CUSTOM <
+        __atomic_load_n(&gpt_custom_count, __ATOMIC_ACQUIRE)) {
+    return gpt_custom_types[type - GPT_TYPE_CUSTOM].name;
+  }
+  return NULL;
+}
+
+enum GPT_Type gpt_register_type(const uint8_t *guid, const char *name) {
+  static const uint8_t unused[16];
+  if (name == NULL || memcmp(guid, unused, 16) == 0) {
+    return GPT_TYPE_UNKNOWN;
+  }
+
+  pthread_mutex_lock(&gpt_custom_mutex);
+  enum GPT_Type type = gpt_lookup_builtin_type(guid);
+  if (type == GPT_TYPE_UNKNOWN) {
+    type = gpt_lookup_custom_type(guid);
+  }
+  if (type != GPT_TYPE_UNKNOWN || gpt_custom_count == GPT_MAX_CUSTOM_TYPES) {
+    pthread_mutex_unlock(&gpt_custom_mutex);
+    return type;
+  }
+
+  struct GPT_Custom_Type *custom = gpt_custom_types + gpt_custom_count;
+  custom->name = strdup(name);
+  if (custom->name == NULL) {
+    pthread_mutex_unlock(&gpt_custom_mutex);
+    return GPT_TYPE_UNKNOWN;
+  }
+  memcpy(custom->guid, guid, 16);
+
+  uint32_t slot = gpt_type_hash(guid, 0) & (GPT_CUSTOM_SLOTS - 1);
+  while (gpt_custom_slots[slot] != 0) {
+    slot = (slot + 1) & (GPT_CUSTOM_SLOTS - 1);
+  }
+  type = GPT_TYPE_CUSTOM + gpt_custom_count;
+  __atomic_store_n(&gpt_custom_count, gpt_custom_count + 1, __ATOMIC_RELEASE);
+  __atomic_store_n(gpt_custom_slots + slot, type - GPT_TYPE_CUSTOM + 1,
+                    __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&gpt_custom_mutex);
+
+  return type;
+}
@@ -0,0 +1,79 @@
+/**
+ * Copyright (c) 2017 Viktor Schneider <info@vjs.io>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <gpt-manipulator.h>
+#include <string.h>
+
+struct GPT_Type_Slot {
+  uint8_t guid[16];
+  enum GPT_Type type;
+};
+
+/**
+ * Hash type GUID, shared by table generator and lookup
+ */
+static inline uint32_t gpt_type_hash(const uint8_t *guid, uint32_t seed) {
+  uint64_t low, high;
+  memcpy(&low, guid, sizeof(low));
+  memcpy(&high, guid + 8, sizeof(high));
+
+  uint64_t hash = (low ^ (seed * 0x9E3779B97F4A7C15ULL)) * 0xBF58476D1CE4E5B9ULL;
+  hash ^= (hash >> 29) ^ high;
+  hash *= 0x94D049BB133111EBULL;
+  return (uint32_t)(hash ^ (hash >> 32));
+}
+
+/**
+ * Map hash to [0, range) without division
+ */
+static inline uint32_t gpt_type_reduce(uint32_t hash, uint32_t range) {
+  return (uint32_t)(((uint64_t)hash * range) >> 32);
+}
+
+/**
+ * Parse textual GUID to on-disk byte order
+ */
+static inline int gpt_type_parse_guid(const char *text, uint8_t *guid) {
+  static const int order[16] = {3, 2, 1, 0, 5, 4, 7, 6,
+                                8, 9, 10, 11, 12, 13, 14, 15};
+  for (int x = 0; x < 16; x++) {
+    if (*text == '-') {
+      text++;
+    }
+    int value = 0;
+    for (int y = 0; y < 2; y++, text++) {
+      char c = *text;
+      value <<= 4;
+      if (c >= '0' && c <= '9') {
+        value |= c - '0';
+      } else if (c >= 'A' && c <= 'F') {
+        value |= c - 'A' + 10;
+      } else if (c >= 'a' && c <= 'f') {
+        value |= c - 'a' + 10;
+      } else {
+        return 0;
+      }
+    }
+    guid[order[x]] = value;
+  }
+  return *text == '\0';
+}
@@ -0,0 +1,106 @@
+extern "C" {
+#include "../src/gpt-manipulator.h"
+}
+#include <cstdio>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+ * Drives two handles on one image through a cache miss that races with a
+ * write: the stale header read before the write must not replace the
+ * header the writer published.
+ */
+
+int main() {
+  const char *path = "cache-test.img";
+  std::string name = "/gpt-manipulator-test-" + std::to_string(getpid());
+  FILE *file = fopen(path, "w");
+  if (file == NULL || fclose(file) != 0 || truncate(path, 8 << 20) != 0) {
+    return 1;
+  }
+
+  struct GPT_Handle *writer = gpt_create_handle(path, 512, 1, false);
+  if (writer == NULL || gpt_create_table(writer, 0, 128, NULL) != GPT_SUCCESS) {
+    return 2;
+  }
+  struct GPT_Handle *reader = gpt_create_handle(path, 512, 1, true);
+  struct GPT_Cache *cache = gpt_cache_open(name.c_str(), 4);
+  if (reader == NULL || cache == NULL || !gpt_cache_attach(cache, writer) ||
+      !gpt_cache_attach(cache, reader)) {
+    return 3;
+  }
+
+  /* reader misses and reads the old header from disk */
+  struct GPT_Header cached;
+  uint64_t sequence;
+  if (gpt_cache_get_header(reader, &cached, &sequence)) {
+    return 4;
+  }
+  struct GPT_Header *old = gpt_read_header_with_mbr(reader, NULL);
+
+  /* writer stores and publishes a new header in between */
+  struct GPT_Header *current = gpt_read_header_with_mbr(writer, NULL);
+  current->guid[0] ^= 0xFF;
+  gpt_refresh_crc32(current);
+  if (gpt_write_header(writer, current) != GPT_SUCCESS) {
+    return 5;
+  }
+
+  /* late fill of the stale header is dropped */
+  gpt_cache_publish_header(reader, old, &sequence);
+  if (!gpt_cache_get_header(reader, &cached, &sequence) ||
+      cached.crc32_header != current->crc32_header) {
+    return 6;
+  }
+  struct GPT_Header *header = gpt_read_header(reader);
+  if (header == NULL || header->crc32_header != current->crc32_header) {
+    return 7;
+  }
+  gpt_free_header(header);
+
+  /* fill without a concurrent write is kept */
+  gpt_cache_invalidate(reader);
+  if (gpt_cache_get_header(reader, &cached, &sequence)) {
+    return 8;
+  }
+  gpt_cache_publish_header(reader, current, &sequence);
+  if (!gpt_cache_get_header(reader, &cached, &sequence) ||
+      cached.crc32_header != current->crc32_header) {
+    return 9;
+  }
+
+  /* entries follow the same rule */
+  struct GPT_Entry *entries = gpt_get_all_entries(writer, current);
+  struct GPT_Entry *stale = gpt_get_all_entries(writer, current);
+  gpt_cache_invalidate(reader);
+  struct GPT_Entry copy[128];
+  if (gpt_cache_get_entries(reader, current, copy, &sequence)) {
+    return 10;
+  }
+  entries[0].first_lba = 100;
+  entries[0].last_lba = 200;
+  entries[0].type_guid[0] = 1;
+  gpt_refresh_entries(current, entries);
+  gpt_refresh_crc32(current);
+  if (gpt_write_entries(writer, current, entries) != GPT_SUCCESS ||
+      gpt_write_header(writer, current) != GPT_SUCCESS) {
+    return 11;
+  }
+  gpt_cache_publish_entries(reader, old, stale, &sequence);
+  if (!gpt_cache_get_entries(reader, current, copy, &sequence) ||
+      copy[0].first_lba != 100) {
+    return 12;
+  }
+
+  gpt_free_entries(entries);
+  gpt_free_entries(stale);
+  gpt_free_header(current);
+  gpt_free_header(old);
+  gpt_close_handle(reader);
+  gpt_close_handle(writer);
+  gpt_cache_close(cache);
+  shm_unlink(name.c_str());
+  unlink(path);
+  return 0;
+}
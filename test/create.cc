@@ -0,0 +1,100 @@
+#include <gpt-manipulator.h>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* true if the LBA range of the image holds only zero bytes */
+static bool is_zero(const char *path, uint64_t lba, uint64_t count) {
+  int fd = open(path, O_RDONLY);
+  char data[512];
+  bool zero = fd >= 0;
+  for (uint64_t x = 0; zero && x < count; x++) {
+    zero = pread(fd, data, sizeof(data), (lba + x) * 512) == sizeof(data);
+    for (size_t y = 0; zero && y < sizeof(data); y++) {
+      zero = data[y] == 0;
+    }
+  }
+  close(fd);
+  return zero;
+}
+
+/* allocated bytes stay far below the apparent size of sparse images */
+static bool is_sparse(const char *path, off_t size) {
+  struct stat st;
+  return stat(path, &st) == 0 && st.st_size == size &&
+          st.st_blocks * 512 < (1 << 20);
+}
+
+static bool verify(struct GPT_Handle *handle, struct GPT_Header *header) {
+  struct GPT_Entry *entries = gpt_get_all_entries(handle, header);
+  bool valid = entries != NULL &&
+                gpt_verify_header(handle, header) == GPT_SUCCESS &&
+                gpt_verify_entries(handle, header, entries) == GPT_SUCCESS &&
+                gpt_verify_scondary_header(handle, header) == GPT_SUCCESS;
+  gpt_free_entries(entries);
+  return valid;
+}
+
+int main() {
+  const char *path = "create-test.img";
+  FILE *file = fopen(path, "w");
+  if (file == NULL || fclose(file) != 0) {
+    return 1;
+  }
+
+  /* empty file is extended sparsely to 64 MiB */
+  struct GPT_Handle *handle = gpt_create_handle(path, 512, 1, false);
+  if (handle == NULL ||
+      gpt_create_table(handle, 131072, 128, NULL) != GPT_SUCCESS ||
+      !is_sparse(path, 64 << 20)) {
+    return 2;
+  }
+  struct GPT_Header *header = gpt_read_header(handle);
+  if (header == NULL || header->position_secondary != 131071 ||
+      header->last_partition_lba != 131038 || !verify(handle, header)) {
+    return 3;
+  }
+
+  struct GPT_Entry *entries = gpt_get_all_entries(handle, header);
+  if (entries == NULL) {
+    return 4;
+  }
+  entries[0].type_guid[0] = 1;
+  entries[0].guid[0] = 1;
+  entries[0].first_lba = 2048;
+  entries[0].last_lba = 131038;
+  gpt_refresh_entries(header, entries);
+  gpt_refresh_crc32(header);
+  if (gpt_write_entries(handle, header, entries) != GPT_SUCCESS ||
+      gpt_write_header(handle, header) != GPT_SUCCESS ||
+      is_zero(path, 131071, 1)) {
+    return 5;
+  }
+
+  /* grow to 128 MiB, the backup table moves to the new end */
+  if (gpt_relocate_secondary(handle, header, entries, 262144) != GPT_SUCCESS ||
+      header->position_secondary != 262143 ||
+      header->last_partition_lba != 262110 ||
+      !is_sparse(path, 128 << 20)) {
+    return 6;
+  }
+  gpt_free_header(header);
+  header = gpt_read_header(handle);
+  if (header == NULL || header->position_secondary != 262143 ||
+      !verify(handle, header)) {
+    return 7;
+  }
+
+  /* stale backup header is gone */
+  if (!is_zero(path, 131071, 1)) {
+    return 8;
+  }
+
+  gpt_free_entries(entries);
+  gpt_free_header(header);
+  gpt_close_handle(handle);
+  unlink(path);
+  return 0;
+}
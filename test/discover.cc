@@ -0,0 +1,92 @@
+#include <gpt-manipulator.h>
+#include <cstdio>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+static bool make_table(const char *path, off_t size,
+                        const std::vector<std::pair<uint64_t, uint64_t>> &parts) {
+  FILE *file = fopen(path, "w");
+  if (file == NULL || fclose(file) != 0 || truncate(path, size) != 0) {
+    return false;
+  }
+  struct GPT_Handle *handle = gpt_create_handle(path, 512, 1, false);
+  if (handle == NULL || gpt_create_table(handle, 0, 128, NULL) != GPT_SUCCESS) {
+    return false;
+  }
+  struct GPT_Header *header = gpt_read_header(handle);
+  struct GPT_Entry *entries = gpt_get_all_entries(handle, header);
+  for (size_t x = 0; x < parts.size(); x++) {
+    entries[x].type_guid[0] = 1;
+    entries[x].guid[0] = x + 1;
+    entries[x].first_lba = parts[x].first;
+    entries[x].last_lba = parts[x].second;
+  }
+  gpt_refresh_entries(header, entries);
+  gpt_refresh_crc32(header);
+  bool written = gpt_write_entries(handle, header, entries) == GPT_SUCCESS &&
+                  gpt_write_header(handle, header) == GPT_SUCCESS;
+  gpt_free_entries(entries);
+  gpt_free_header(header);
+  gpt_close_handle(handle);
+  return written;
+}
+
+/* copy image into the disk at LBA lba */
+static bool embed(const char *disk, const char *image, uint64_t lba) {
+  int in = open(image, O_RDONLY);
+  int out = open(disk, O_WRONLY);
+  std::vector<char> data(1 << 20);
+  ssize_t length = in < 0 ? -1 : pread(in, data.data(), data.size(), 0);
+  bool copied = length == (ssize_t)data.size() && out >= 0 &&
+                pwrite(out, data.data(), length, lba * 512) == length;
+  close(in);
+  close(out);
+  unlink(image);
+  return copied;
+}
+
+int main() {
+  const char *path = "discover-test.img";
+  if (!make_table(path, 16 << 20, {{2048, 4095}, {4096, 6143}, {8192, 8291}}) ||
+      !make_table("discover-inner.img", 1 << 20, {{100, 200}}) ||
+      !embed(path, "discover-inner.img", 2048) ||
+      !make_table("discover-inner.img", 1 << 20, {{100, 200}, {300, 400}}) ||
+      !embed(path, "discover-inner.img", 4096)) {
+    return 1;
+  }
+
+  struct GPT_Handle *handle = gpt_create_handle(path, 512, 1, true);
+  if (handle == NULL) {
+    return 2;
+  }
+
+  /* 0 selects default limits */
+  struct GPT_Discover_Options options = {4, 0, 0};
+  struct GPT_Table_Node *root = gpt_discover_tables(handle, &options);
+  if (root == NULL || root->child_count != 2 || root->lba_count != 32768) {
+    return 3;
+  }
+  struct GPT_Table_Node *first = root->children[0];
+  struct GPT_Table_Node *second = root->children[1];
+  if (first->depth != 1 || first->parent_entry != 0 ||
+      first->offset != 2048 * 512 || first->lba_count != 2048 ||
+      first->child_count != 0 || second->parent_entry != 1 ||
+      second->offset != 4096 * 512 || second->entries[1].first_lba != 300) {
+    return 4;
+  }
+  gpt_free_table_tree(root);
+
+  /* level limit applies in entry order */
+  options.max_tables_per_level = 1;
+  root = gpt_discover_tables(handle, &options);
+  if (root == NULL || root->child_count != 1 ||
+      root->children[0]->parent_entry != 0) {
+    return 5;
+  }
+  gpt_free_table_tree(root);
+
+  gpt_close_handle(handle);
+  unlink(path);
+  return 0;
+}
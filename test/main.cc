@@ -2,7 +2,10 @@
 #include <iostream>
 #include <bitset>
 #include <cstring>
+#include <fstream>
+#include <vector>
 #include <error.h>
+#include <unistd.h>
 
 struct UUID {
   uint32_t time_low;
@@ -29,9 +32,19 @@ void printGUID(const char *prefix, struct UUID *uuid) {
   std::cout.unsetf(std::ios::uppercase);
 }
 
-int main() {
+int main(int argc, char **argv) {
+  /* work on a copy, the image in the source tree stays untouched */
+  const char *path = "main-test.img";
+  {
+    std::ifstream in(argc > 1 ? argv[1] : "../test/test.img", std::ios::binary);
+    std::ofstream out(path, std::ios::binary);
+    if (!in || !(out << in.rdbuf())) {
+      return 1;
+    }
+  }
+
   struct GPT_Handle *handle;
-  handle = gpt_create_handle("../test/test.img",
+  handle = gpt_create_handle(path,
                                             GPT_DEFAULT_LBA_SIZE,
                                             GPT_DEFAULT_OFFSET,
                                             false);
@@ -74,7 +87,7 @@ int main() {
   std::cout.setf(std::ios::dec, std::ios::basefield);
   std::cout.unsetf(std::ios::showbase);
 
-  for (int x = 0; x < header->entries; x++) {
+  for (uint32_t x = 0; x < header->entries; x++) {
     /* skip unused entries */
     if (*reinterpret_cast<uint64_t *>(entries[x].type_guid) == 0 && *(reinterpret_cast<uint64_t *>(entries[x].type_guid) + 1) == 0) {
       continue;
@@ -92,15 +105,24 @@ int main() {
     std::cout << std::endl;
   }
 
-  /* swap two partitions */
-  struct GPT_Entry cache;
-  std::memcpy(&cache, entries + 1, sizeof(struct GPT_Entry));
-
-  std::memcpy(entries + 1, entries + 2, sizeof(struct GPT_Entry));
-  std::memcpy(entries + 2, &cache, sizeof(struct GPT_Entry));
-
+  /* test.img stores its partitions out of order: 34, 76, 55 */
+  std::vector<uint32_t> permutation(header->entries);
+  if (gpt_sort_entries(header, entries, permutation.data()) != GPT_SUCCESS) {
+    return 4;
+  }
+  if (entries[0].first_lba != 34 || entries[1].first_lba != 55 ||
+      entries[2].first_lba != 76 || permutation[0] != 0 ||
+      permutation[1] != 2 || permutation[2] != 1) {
+    return 5;
+  }
+  uint32_t crc32_entries = header->crc32_entries;
+  uint32_t crc32_header = header->crc32_header;
   gpt_refresh_entries(header, entries);
   gpt_refresh_crc32(header);
+  if (header->crc32_entries != crc32_entries ||
+      header->crc32_header != crc32_header) {
+    return 6;
+  }
 
   std::cout << std::endl;
   GPT_Error error;
@@ -117,8 +139,23 @@ int main() {
     std::cout << "failed to write primary header" << " code: " << error << std::endl;
   }
 
+  gpt_free_entries(entries);
+  gpt_free_header(header);
+
+  /* sorted table is read back with valid checksums */
+  header = gpt_read_header(handle);
+  if (header == NULL || gpt_verify_header(handle, header) != GPT_SUCCESS) {
+    return 7;
+  }
+  entries = gpt_get_all_entries(handle, header);
+  if (entries == NULL || entries[1].first_lba != 55 ||
+      entries[2].first_lba != 76) {
+    return 8;
+  }
+
   gpt_free_entries(entries);
   gpt_free_header(header);
   gpt_close_handle(handle);
+  unlink(path);
   return 0;
 }
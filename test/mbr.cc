@@ -0,0 +1,90 @@
+#include <gpt-manipulator.h>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+static struct GPT_Header *read_table(struct GPT_Handle *handle,
+                                      struct GPT_MBR *mbr) {
+  struct GPT_Header *header = gpt_read_header_with_mbr(handle, mbr);
+  if (header != NULL && gpt_verify_header(handle, header) != GPT_SUCCESS) {
+    gpt_free_header(header);
+    return NULL;
+  }
+  return header;
+}
+
+int main() {
+  const char *path = "mbr-test.img";
+  FILE *file = fopen(path, "w");
+  if (file == NULL || fclose(file) != 0 || truncate(path, 8 << 20) != 0) {
+    return 1;
+  }
+
+  /* protective MBR written with a new table */
+  struct GPT_Handle *handle = gpt_create_handle(path, 512, 1, false);
+  if (handle == NULL ||
+      gpt_create_table(handle, 0, 128, NULL) != GPT_SUCCESS) {
+    return 2;
+  }
+  struct GPT_MBR mbr;
+  struct GPT_Header *header = read_table(handle, &mbr);
+  if (header == NULL || gpt_mbr_type(&mbr) != GPT_MBR_PROTECTIVE ||
+      gpt_verify_mbr(handle, header, &mbr) != GPT_SUCCESS ||
+      mbr.partitions[0].first_lba != 1 ||
+      mbr.partitions[0].sectors != 16383) {
+    return 3;
+  }
+
+  /* resized disk is detected and fixed by relocation */
+  if (truncate(path, 16 << 20) != 0 ||
+      gpt_verify_mbr(handle, header, &mbr) != GPT_BAD_SECONDARY_POSITION) {
+    return 4;
+  }
+  struct GPT_Entry *entries = gpt_get_all_entries(handle, header);
+  if (entries == NULL ||
+      gpt_relocate_secondary(handle, header, entries, 0) != GPT_SUCCESS) {
+    return 5;
+  }
+  gpt_free_header(header);
+  header = read_table(handle, &mbr);
+  if (header == NULL || gpt_verify_mbr(handle, header, &mbr) != GPT_SUCCESS ||
+      mbr.partitions[0].sectors != 32767) {
+    return 6;
+  }
+
+  /* hybrid MBR with 0xEE covering the GPT area only, like gdisk */
+  mbr.partitions[0].sectors = 2047;
+  mbr.partitions[1] = mbr.partitions[0];
+  mbr.partitions[1].type = 0x0C;
+  mbr.partitions[1].first_lba = 2048;
+  mbr.partitions[1].sectors = 4096;
+  if (gpt_write_mbr(handle, &mbr) != GPT_SUCCESS) {
+    return 7;
+  }
+  gpt_free_header(header);
+  header = read_table(handle, &mbr);
+  if (header == NULL || gpt_mbr_type(&mbr) != GPT_MBR_HYBRID ||
+      gpt_verify_mbr(handle, header, &mbr) != GPT_HYBRID_MBR) {
+    return 8;
+  }
+
+  /* relocation keeps hybrid partitions and the 0xEE size */
+  if (truncate(path, 24 << 20) != 0 ||
+      gpt_relocate_secondary(handle, header, entries, 0) != GPT_SUCCESS) {
+    return 9;
+  }
+  gpt_free_header(header);
+  header = read_table(handle, &mbr);
+  if (header == NULL || gpt_verify_mbr(handle, header, &mbr) != GPT_HYBRID_MBR ||
+      mbr.partitions[0].sectors != 2047 || mbr.partitions[1].type != 0x0C ||
+      mbr.partitions[1].first_lba != 2048 ||
+      mbr.partitions[1].sectors != 4096) {
+    return 10;
+  }
+
+  gpt_free_entries(entries);
+  gpt_free_header(header);
+  gpt_close_handle(handle);
+  unlink(path);
+  return 0;
+}
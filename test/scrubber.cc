@@ -0,0 +1,80 @@
+#include <gpt-manipulator.h>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <fcntl.h>
+#include <unistd.h>
+
+struct Reports {
+  std::mutex mutex;
+  std::condition_variable changed;
+  int secondary = 0;
+  int other = 0;
+};
+
+static void report(struct GPT_Handle *, enum GPT_Scrub_Check check,
+                    enum GPT_Error error, void *data) {
+  Reports *reports = static_cast<Reports *>(data);
+  std::lock_guard<std::mutex> lock(reports->mutex);
+  if (check == GPT_SCRUB_SECONDARY && error == GPT_CRC32_MISMATCH) {
+    reports->secondary++;
+  } else {
+    reports->other++;
+  }
+  reports->changed.notify_all();
+}
+
+int main() {
+  const char *path = "scrubber-test.img";
+  FILE *file = fopen(path, "w");
+  if (file == NULL || fclose(file) != 0 || truncate(path, 8 << 20) != 0) {
+    return 1;
+  }
+  struct GPT_Handle *handle = gpt_create_handle(path, 512, 1, false);
+  if (handle == NULL || gpt_create_table(handle, 0, 128, NULL) != GPT_SUCCESS) {
+    return 2;
+  }
+
+  /* NULL selects default options */
+  struct GPT_Scrubber *scrubber = gpt_scrubber_create(NULL);
+  if (scrubber == NULL || !gpt_scrubber_add(scrubber, handle, 0) ||
+      !gpt_scrubber_remove(scrubber, handle)) {
+    return 3;
+  }
+  gpt_free_scrubber(scrubber);
+
+  /* damage the backup header only */
+  int fd = open(path, O_WRONLY);
+  if (fd < 0 || pwrite(fd, "X", 1, 16383 * 512 + 16) != 1) {
+    return 4;
+  }
+  close(fd);
+
+  Reports reports;
+  struct GPT_Scrubber_Options options = {};
+  options.interval = 10;
+  options.callback = report;
+  options.data = &reports;
+  scrubber = gpt_scrubber_create(&options);
+  if (scrubber == NULL || !gpt_scrubber_add(scrubber, handle, 0)) {
+    return 5;
+  }
+
+  /* reported again on every pass */
+  bool reported;
+  {
+    std::unique_lock<std::mutex> lock(reports.mutex);
+    reported = reports.changed.wait_for(lock, std::chrono::seconds(5), [&] {
+      return reports.secondary >= 2;
+    });
+  }
+  gpt_free_scrubber(scrubber);
+  if (!reported || reports.other != 0) {
+    return 6;
+  }
+
+  gpt_close_handle(handle);
+  unlink(path);
+  return 0;
+}
@@ -0,0 +1,121 @@
+#include <gpt-manipulator.h>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+static const uint8_t efi_system[16] = {0x28, 0x73, 0x2A, 0xC1, 0x1F, 0xF8,
+                                        0xD2, 0x11, 0xBA, 0x4B, 0x00, 0xA0,
+                                        0xC9, 0x3E, 0xC9, 0x3B};
+static const uint8_t linux_data[16] = {0xAF, 0x3D, 0xC6, 0x0F, 0x83, 0x84,
+                                        0x72, 0x47, 0x8E, 0x79, 0x3D, 0x69,
+                                        0xD8, 0x47, 0x7D, 0xE4};
+
+static void make_entry(struct GPT_Entry *entry, const uint8_t *type,
+                        uint64_t first, uint64_t last, const char *name) {
+  memcpy(entry->type_guid, type, 16);
+  entry->guid[0] = first;
+  entry->first_lba = first;
+  entry->last_lba = last;
+  for (int x = 0; name[x] != '\0'; x++) {
+    entry->name[x] = name[x];
+  }
+}
+
+int main() {
+  const char *path = "snapshot-test.snap";
+
+  struct GPT_Header header;
+  memset(&header, 0, sizeof(struct GPT_Header));
+  memcpy(header.signature, GPT_DEFAULT_SIGNATURE, 8);
+  header.revision = GPT_REVISION;
+  header.header_size = 92;
+  header.position_primary = 1;
+  header.position_secondary = 32767;
+  header.first_partition_lba = 34;
+  header.last_partition_lba = 32734;
+  header.guid[0] = 0x42;
+  header.position_entries = 2;
+  header.entries = 4;
+  header.entry_size = 128;
+
+  struct GPT_Entry entries[4];
+  memset(entries, 0, sizeof(entries));
+  make_entry(entries + 0, efi_system, 34, 2081, "EFI \"boot\"");
+  make_entry(entries + 2, linux_data, 2082, 4129, "root");
+  make_entry(entries + 3, efi_system, 4130, 6177, "spare");
+  gpt_refresh_entries(&header, entries);
+  gpt_refresh_crc32(&header);
+
+  struct GPT_Snapshot_Writer *writer = gpt_snapshot_create(path);
+  if (writer == NULL || gpt_snapshot_add(writer, &header, entries) != GPT_SUCCESS) {
+    return 1;
+  }
+  header.guid[0] = 0x43;
+  if (gpt_snapshot_add(writer, &header, entries) != GPT_SUCCESS ||
+      gpt_snapshot_close(writer) != GPT_SUCCESS) {
+    return 2;
+  }
+
+  struct GPT_Snapshot *snapshot = gpt_snapshot_open(path);
+  if (snapshot == NULL || gpt_snapshot_tables(snapshot) != 2) {
+    return 3;
+  }
+
+  struct GPT_Header read;
+  if (!gpt_snapshot_get_header(snapshot, 1, &read) || read.guid[0] != 0x43 ||
+      read.position_secondary != 32767 || read.entries != 4 ||
+      read.crc32_entries != header.crc32_entries ||
+      gpt_snapshot_get_header(snapshot, 2, &read)) {
+    return 4;
+  }
+
+  /* only used entries are stored, types are shared */
+  uint32_t count = 0;
+  const struct GPT_Snapshot_Entry *stored =
+                                  gpt_snapshot_get_entries(snapshot, 0, &count);
+  if (stored == NULL || count != 3 || stored[1].slot != 2 ||
+      stored[1].first_lba != 2082 || stored[2].last_lba != 6177 ||
+      stored[0].type_index != stored[2].type_index ||
+      stored[0].type_index == stored[1].type_index ||
+      memcmp(gpt_snapshot_type_guid(snapshot, stored[1].type_index),
+              linux_data, 16) != 0 ||
+      gpt_snapshot_type_guid(snapshot, 2) != NULL) {
+    return 5;
+  }
+  gpt_snapshot_free(snapshot);
+
+  char json[2048];
+  size_t length = gpt_json_table(json, sizeof(json), &header, entries);
+  if (length != strlen(json) ||
+      strstr(json, "\"position_secondary\":32767") == NULL ||
+      strstr(json, "{\"index\":2,\"type_guid\":"
+                    "\"0FC63DAF-8483-4772-8E79-3D69D8477DE4\"") == NULL ||
+      strstr(json, "\"name\":\"EFI \\\"boot\\\"\"") == NULL ||
+      strstr(json, "\"index\":1,") != NULL) {
+    return 6;
+  }
+
+  /* truncated like snprintf */
+  char small[16];
+  if (gpt_json_table(small, sizeof(small), &header, entries) != length ||
+      strlen(small) != sizeof(small) - 1 ||
+      strncmp(small, json, sizeof(small) - 1) != 0) {
+    return 7;
+  }
+
+  /* index offset near 2^64 must not wrap around the bounds check */
+  int fd = open(path, O_RDWR);
+  uint64_t index_offset = UINT64_MAX - 7;
+  if (fd < 0 || pwrite(fd, &index_offset, sizeof(index_offset), 32) !=
+                  sizeof(index_offset)) {
+    return 8;
+  }
+  close(fd);
+  if (gpt_snapshot_open(path) != NULL) {
+    return 9;
+  }
+
+  unlink(path);
+  return 0;
+}
@@ -0,0 +1,93 @@
+#include <gpt-manipulator.h>
+#include <cstdio>
+#include <cstring>
+
+struct Builtin {
+  enum GPT_Type type;
+  const char *guid;
+  const char *name;
+};
+
+static const Builtin builtins[] = {
+#define GPT_TYPE(type, guid, name) {type, guid, name},
+#include "../src/gpt-types.def"
+#undef GPT_TYPE
+};
+
+/* first three GUID fields are stored little endian */
+static void parse_guid(const char *text, uint8_t *guid) {
+  static const int order[16] = {3, 2, 1, 0, 5, 4, 7, 6,
+                                8, 9, 10, 11, 12, 13, 14, 15};
+  for (int x = 0; x < 16; x++) {
+    unsigned int byte;
+    sscanf(text, "%2x", &byte);
+    guid[order[x]] = byte;
+    text += text[2] == '-' ? 3 : 2;
+  }
+}
+
+int main() {
+  struct GPT_Entry entry;
+  memset(&entry, 0, sizeof(struct GPT_Entry));
+
+  /* every built-in type is found through the generated table */
+  const char *name;
+  for (const Builtin &builtin : builtins) {
+    parse_guid(builtin.guid, entry.type_guid);
+    if (gpt_classify_entry(&entry, &name) != builtin.type ||
+        strcmp(name, builtin.name) != 0 ||
+        strcmp(gpt_type_name(builtin.type), builtin.name) != 0) {
+      return 1;
+    }
+  }
+
+  parse_guid("C12A7328-F81F-11D2-BA4B-00A0C93EC93B", entry.type_guid);
+  if (gpt_classify_entry(&entry, NULL) != GPT_TYPE_EFI_SYSTEM) {
+    return 2;
+  }
+
+  /* unknown and unused GUIDs */
+  parse_guid("01234567-89AB-CDEF-0123-456789ABCDEF", entry.type_guid);
+  if (gpt_classify_entry(&entry, &name) != GPT_TYPE_UNKNOWN) {
+    return 3;
+  }
+  uint8_t unused[16] = {0};
+  if (gpt_register_type(unused, "unused") != GPT_TYPE_UNKNOWN) {
+    return 4;
+  }
+
+  /* registered types are classified, registering again is a no-op */
+  enum GPT_Type custom = gpt_register_type(entry.type_guid, "custom");
+  if (custom < GPT_TYPE_CUSTOM ||
+      gpt_classify_entry(&entry, &name) != custom ||
+      strcmp(name, "custom") != 0 ||
+      strcmp(gpt_type_name(custom), "custom") != 0 ||
+      gpt_register_type(entry.type_guid, "other") != custom ||
+      gpt_type_name((enum GPT_Type)(custom + 1)) != NULL) {
+    return 5;
+  }
+
+  /* built-in types can't be registered again */
+  parse_guid("0FC63DAF-8483-4772-8E79-3D69D8477DE4", entry.type_guid);
+  if (gpt_register_type(entry.type_guid, "linux") !=
+        GPT_TYPE_LINUX_FILESYSTEM) {
+    return 6;
+  }
+
+  /* batch classification matches single lookups */
+  struct GPT_Header header;
+  memset(&header, 0, sizeof(struct GPT_Header));
+  header.entries = 3;
+  struct GPT_Entry entries[3];
+  memset(entries, 0, sizeof(entries));
+  parse_guid("21686148-6449-6E6F-744E-656564454649", entries[0].type_guid);
+  parse_guid("01234567-89AB-CDEF-0123-456789ABCDEF", entries[2].type_guid);
+  enum GPT_Type types[3];
+  gpt_classify_entries(&header, entries, types);
+  if (types[0] != GPT_TYPE_BIOS_BOOT || types[1] != GPT_TYPE_UNUSED ||
+      types[2] != custom) {
+    return 7;
+  }
+
+  return 0;
+}
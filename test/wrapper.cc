@@ -0,0 +1,58 @@
+#include <gpt-manipulator.hpp>
+#include <iostream>
+#include <unordered_set>
+
+using namespace gpt::literals;
+
+constexpr gpt::Guid efi_system = "C12A7328-F81F-11D2-BA4B-00A0C93EC93B"_guid;
+
+static_assert(efi_system.bytes[0] == 0x28 && efi_system.bytes[3] == 0xC1);
+static_assert(efi_system.bytes[15] == 0x3B);
+static_assert(!gpt::Guid::parse("C12A7328-F81F-11D2-BA4B-00A0C93EC93"));
+static_assert(!gpt::Guid::parse("C12A7328-F81F-11D2-BA4B-00A0C93EC93X"));
+static_assert(std::hash<gpt::Guid>()(efi_system) == efi_system.hash());
+
+int main() {
+  gpt::Handle handle = gpt::Handle::open("../test/test.img");
+  if (!handle) {
+    return 1;
+  }
+
+  gpt::Table table = gpt::Table::read(handle);
+  if (!table) {
+    return 2;
+  }
+
+  /* moved from objects must not be freed twice */
+  gpt::Handle moved = std::move(handle);
+  gpt::Table current = std::move(table);
+  if (handle || table) {
+    return 3;
+  }
+
+  std::unordered_set<gpt::Guid> types;
+  int used = 0;
+  for (const GPT_Entry &entry : current.used_entries()) {
+    std::cout << gpt::guid(entry).to_string() << " "
+              << gpt::type_guid(entry).to_string() << " "
+              << entry.first_lba << "-" << entry.last_lba << std::endl;
+    types.insert(gpt::type_guid(entry));
+    used++;
+  }
+  if (used != 3 || types.size() != 3 || !types.contains(efi_system)) {
+    return 4;
+  }
+
+  const GPT_Entry *entry = current.find(gpt::guid(current.entries()[0]));
+  if (entry != current.entries().data()) {
+    return 5;
+  }
+
+  gpt::Handle detected = gpt::Handle::autodetect("../test/test.img");
+  if (!detected || detected.get()->lba_size != 512 ||
+      detected.get()->offset != 512) {
+    return 6;
+  }
+
+  return 0;
+}